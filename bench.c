@@ -0,0 +1,297 @@
+#define _POSIX_C_SOURCE 200809L // clock_gettime(), getopt(), mkstemp()
+#include "cfg_parse.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Synthetic benchmark for ParseConfig() and friends.
+ *
+ * Generates a config in memory from the shape given on the command line,
+ * then times parsing (from the buffer and from a file), loading a binary
+ * snapshot of it, FindValue(), DumpConfig() and FreeConfig() over it.
+ */
+
+typedef struct Shape {
+    long Keys;        // number of config lines
+    long ArrayLength; // elements per array, 0 for no arrays
+    int ArrayPercent; // share of lines holding an array
+    int StringPercent; // share of values that are quoted strings
+    int CommentPercent; // share of lines followed by a comment line
+    int Iterations;
+    int Threads; // for ParseConfigParallel(), 0 for none
+    int Flags; // PARSE_* flags
+} Shape;
+
+static double Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int Percent(int pct) { return rand() % 100 < pct; }
+
+static size_t GenerateValue(char *out, const Shape *shape) {
+    if (Percent(shape->StringPercent))
+        return sprintf(out, "'value string %d'", rand());
+    if (rand() % 2)
+        return sprintf(out, "%d", rand());
+    if (rand() % 2)
+        return sprintf(out, "0x%X", rand());
+    return sprintf(out, "%d.%d", rand() % 100000, rand() % 1000);
+}
+
+static char *Generate(const Shape *shape, size_t *len) {
+    size_t cap = 1 << 20, used = 0;
+    char *buf = malloc(cap);
+    for (long i = 0; i < shape->Keys; i++) {
+        // Worst case line: key + array of values + comment
+        size_t need = 128 + (size_t)shape->ArrayLength * 32;
+        if (used + need > cap) {
+            while (used + need > cap)
+                cap *= 2;
+            buf = realloc(buf, cap);
+        }
+
+        used += sprintf(buf + used, "key_%ld = ", i);
+        if (shape->ArrayLength && Percent(shape->ArrayPercent)) {
+            buf[used++] = '[';
+            for (long j = 0; j < shape->ArrayLength; j++) {
+                if (j)
+                    buf[used++] = ',';
+                used += GenerateValue(buf + used, shape);
+            }
+            buf[used++] = ']';
+        } else {
+            used += GenerateValue(buf + used, shape);
+        }
+        used += sprintf(buf + used, ";\n");
+
+        if (Percent(shape->CommentPercent))
+            used += sprintf(buf + used, "# comment number %ld for key_%ld\n",
+                            i, i);
+    }
+
+    *len = used;
+    return buf;
+}
+
+static int CompareDouble(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void Report(const char *what, double secs, size_t bytes,
+                   uint64_t entries) {
+    printf("%-14s %10.3f ms %10.1f MB/s %12.0f entries/s\n", what,
+           secs * 1e3, bytes / secs / 1e6, entries / secs);
+}
+
+static int Usage(const char *prog) {
+    printf("Usage: %s [-k KEYS] [-a ARRAY_LENGTH] [-A ARRAY_PERCENT]\n"
+           "          [-s STRING_PERCENT] [-c COMMENT_PERCENT] "
+           "[-i ITERATIONS] [-t THREADS] [-m] [-z]\n"
+           "  -t  also time ParseConfigParallel() with THREADS threads\n"
+           "  -m  parse files with PARSE_MMAP\n"
+           "  -z  parse with PARSE_ZERO_COPY\n",
+           prog);
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    Shape shape = {100000, 16, 10, 30, 20, 5, 0, 0};
+    int opt;
+    while ((opt = getopt(argc, argv, "k:a:A:s:c:i:t:mz")) != -1) {
+        switch (opt) {
+        case 'k': shape.Keys = atol(optarg); break;
+        case 'a': shape.ArrayLength = atol(optarg); break;
+        case 'A': shape.ArrayPercent = atoi(optarg); break;
+        case 's': shape.StringPercent = atoi(optarg); break;
+        case 'c': shape.CommentPercent = atoi(optarg); break;
+        case 'i': shape.Iterations = atoi(optarg); break;
+        case 't': shape.Threads = atoi(optarg); break;
+        case 'm': shape.Flags |= PARSE_MMAP; break;
+        case 'z': shape.Flags |= PARSE_ZERO_COPY; break;
+        default: return Usage(argv[0]);
+        }
+    }
+    if (shape.Keys <= 0 || shape.Iterations <= 0)
+        return Usage(argv[0]);
+
+    srand(42);
+    size_t len;
+    char *data = Generate(&shape, &len);
+    printf("config: %ld keys, %.2f MB, %d iterations\n", shape.Keys,
+           len / 1e6, shape.Iterations);
+
+    // Parsing the same input from a file exercises the I/O paths too
+    char path[] = "/tmp/cfg_bench_XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0 || write(fd, data, len) != (ssize_t)len) {
+        printf("Cannot write %s\n", path);
+        return 1;
+    }
+    close(fd);
+
+    char snapshot[sizeof(path) + 5];
+    sprintf(snapshot, "%s.snap", path);
+
+    double best_buffer = 1e9, best_file = 1e9, best_dump = 1e9,
+           best_free = 1e9, best_snapshot = 1e9, best_parallel = 1e9;
+    Config *config = NULL;
+    FILE *null = fopen("/dev/null", "w");
+    for (int it = 0; it < shape.Iterations; it++) {
+        double t = Now();
+        int status = ParseConfigBufferEx(data, len, shape.Flags, &config);
+        t = Now() - t;
+        if (status < 0) {
+            printf("%s\n", ErrToString(status));
+            return 1;
+        }
+        if (t < best_buffer)
+            best_buffer = t;
+
+        t = Now();
+        DumpConfig(null, config);
+        t = Now() - t;
+        if (t < best_dump)
+            best_dump = t;
+
+        if (it == 0 && SaveConfigBinary(config, snapshot) < 0) {
+            printf("Cannot write %s\n", snapshot);
+            return 1;
+        }
+
+        t = Now();
+        FreeConfig(config);
+        t = Now() - t;
+        if (t < best_free)
+            best_free = t;
+
+        t = Now();
+        status = LoadConfigBinary(snapshot, &config);
+        t = Now() - t;
+        if (status < 0) {
+            printf("%s\n", ErrToString(status));
+            return 1;
+        }
+        if (t < best_snapshot)
+            best_snapshot = t;
+        FreeConfig(config);
+
+        if (shape.Threads) {
+            t = Now();
+            status = ParseConfigParallel(path, shape.Threads, shape.Flags,
+                                         &config);
+            t = Now() - t;
+            if (status < 0) {
+                printf("%s\n", ErrToString(status));
+                return 1;
+            }
+            if (t < best_parallel)
+                best_parallel = t;
+            FreeConfig(config);
+        }
+
+        t = Now();
+        status = ParseConfigEx(path, shape.Flags, &config);
+        t = Now() - t;
+        if (status < 0) {
+            printf("%s\n", ErrToString(status));
+            return 1;
+        }
+        if (t < best_file)
+            best_file = t;
+
+        // Keep the last one around for the lookups
+        if (it + 1 != shape.Iterations)
+            FreeConfig(config);
+    }
+
+    uint64_t entries = config->Entries;
+    Report("parse buffer", best_buffer, len, entries);
+    Report("parse file", best_file, len, entries);
+    if (shape.Threads)
+        Report("parse parallel", best_parallel, len, entries);
+    Report("load snapshot", best_snapshot, len, entries);
+    Report("dump", best_dump, len, entries);
+    Report("free", best_free, len, entries);
+
+    // What the config costs resident, as parsed and once compacted
+    Config *compact;
+    double compact_time = Now();
+    int status = CompactConfig(config, &compact);
+    compact_time = Now() - compact_time;
+    if (status < 0) {
+        printf("%s\n", ErrToString(status));
+        return 1;
+    }
+    Report("compact", compact_time, len, entries);
+    ConfigMemory parsed, compacted;
+    ConfigMemoryUsage(config, &parsed);
+    ConfigMemoryUsage(compact, &compacted);
+    printf("memory         %.2f MB parsed, %.2f MB compacted, input %.2f MB\n",
+           parsed.Total / 1e6, compacted.Total / 1e6, len / 1e6);
+    FreeConfig(compact);
+
+    // Time lookups one by one, half hits and half misses, in random order
+    long lookups = shape.Keys < 100000 ? shape.Keys : 100000;
+    double *latency = malloc(sizeof(double) * lookups);
+    long hits = 0;
+    for (long i = 0; i < lookups; i++) {
+        char key[32];
+        long n = rand() % shape.Keys;
+        sprintf(key, i % 2 ? "key_%ld" : "missing_%ld", n);
+
+        double t = Now();
+        Value *v = FindValue(config, PRIMITIVE_TYPE, key);
+        if (!v)
+            v = FindValue(config, ARRAY_TYPE, key);
+        latency[i] = Now() - t;
+        hits += v != NULL;
+    }
+
+    qsort(latency, lookups, sizeof(double), CompareDouble);
+    printf("FindValue      %ld lookups, %ld hits: p50 %.0f ns, p90 %.0f ns, "
+           "p99 %.0f ns, max %.0f ns\n",
+           lookups, hits, latency[lookups / 2] * 1e9,
+           latency[lookups * 9 / 10] * 1e9, latency[lookups * 99 / 100] * 1e9,
+           latency[lookups - 1] * 1e9);
+
+    // Same lookups in bulk, as component startup does them
+    char (*names)[32] = malloc(sizeof(*names) * lookups);
+    const char **keys = malloc(sizeof(char *) * lookups);
+    int *types = malloc(sizeof(int) * lookups);
+    Value **out = malloc(sizeof(Value *) * lookups);
+    for (long i = 0; i < lookups; i++) {
+        sprintf(names[i], "key_%ld", rand() % shape.Keys);
+        keys[i] = names[i];
+        types[i] = PRIMITIVE_TYPE;
+    }
+
+    double t = Now();
+    for (long i = 0; i < lookups; i++)
+        out[i] = FindValue(config, types[i], keys[i]);
+    double loop = Now() - t;
+
+    t = Now();
+    for (long i = 0; i < lookups; i += 128) {
+        size_t n = lookups - i < 128 ? lookups - i : 128;
+        FindValues(config, keys + i, types + i, n, out + i);
+    }
+    double batch = Now() - t;
+    printf("FindValues     batches of 128: %.0f ns/key, FindValue loop: "
+           "%.0f ns/key\n", batch / lookups * 1e9, loop / lookups * 1e9);
+
+    free(names);
+    free(keys);
+    free(types);
+    free(out);
+    free(latency);
+    FreeConfig(config);
+    fclose(null);
+    unlink(path);
+    unlink(snapshot);
+    free(data);
+    return 0;
+}
@@ -0,0 +1,25 @@
+#include "cfg_parse.h"
+
+// Build-time generator: turns a config file into C source holding it as
+// a constant Config, see EmbedConfig()
+int main(int argc, const char** argv) {
+    if (argc != 3) {
+        printf("Usage: %s [CONFIGURATION_FILE] [NAME] > OUTPUT.c\n", argv[0]);
+        return 1;
+    }
+
+    Config *config;
+    int status = ParseConfig(argv[1], &config);
+    if (status < 0) {
+        fprintf(stderr, "%s: %s\n", argv[1], ErrToString(status));
+        return 1;
+    }
+
+    status = EmbedConfig(stdout, config, argv[2]);
+    FreeConfig(config);
+    if (status < 0) {
+        fprintf(stderr, "%s\n", ErrToString(status));
+        return 1;
+    }
+    return 0;
+}
@@ -1,12 +1,273 @@
+#define _GNU_SOURCE // strtod_l(), locale_t, MADV_SEQUENTIAL, st_mtim, strdup()
 #include "cfg_parse.h"
-#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <locale.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdalign.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
-#define pushback(file, n) fseek(file, -(n), SEEK_CUR);
+/* Every node of a Config (entries, values, vectors, keys and strings) is
+ * carved out of an arena owned by that Config. Allocation is a pointer
+ * bump, and FreeConfig() releases whole blocks instead of walking nodes.
+ *
+ * Arenas are reference counted: a Config using <include> links to the
+ * entries of the included files and keeps the arenas they live in alive,
+ * see ConfigEntry::Owner and ArenaKeep()
+ */
+typedef struct ArenaBlock {
+    struct ArenaBlock *Next; // the previously filled block
+    size_t Size;
+    size_t Used;
+    alignas(max_align_t) char Data[];
+} ArenaBlock;
+
+typedef struct Arena {
+    ArenaBlock *Head;
+    void *Last; // most recent allocation, the only one ArenaRealloc() can grow in place
+    // Input that PARSE_ZERO_COPY strings point into, released along with
+    // the blocks. Either malloc()ed or, if 'BackingMapped', mmap()ed
+    void *Backing;
+    size_t BackingLength;
+    int BackingMapped;
+    int Refs;
+    size_t FirstBlock; // size of the first block, see ArenaAddBlock()
+    // Other arenas holding nodes this one's Config links to
+    struct Arena **Kept;
+    uint32_t KeptCount;
+    uint32_t KeptCapacity;
+#ifdef CFG_STATS
+    // Counters of the parse filling this arena, see GetConfigStats()
+    ConfigStats Stats;
+#endif
+} Arena;
+
+/* Instrumentation is compiled in with -DCFG_STATS only. Parse counters
+ * live in the arena being filled, so that every chunk of a parallel parse
+ * counts on its own; lookup counters live in the Config
+ */
+#ifdef CFG_STATS
+#define STAT_ADD(field, n) (stats->field += (n))
+#define STAT_ATOMIC_ADD(field, n)                                              \
+    __atomic_add_fetch(&stats->field, (n), __ATOMIC_RELAXED)
+
+static uint64_t StatNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static void MergeStats(ConfigStats *into, const ConfigStats *from) {
+    into->ArrayElements += from->ArrayElements;
+    into->Allocations += from->Allocations;
+    into->AllocatedBytes += from->AllocatedBytes;
+    into->LexNanos += from->LexNanos;
+    into->ConvertNanos += from->ConvertNanos;
+    into->AllocateNanos += from->AllocateNanos;
+}
+#endif
+
+#define ARENA_MIN_BLOCK (16 * 1024)
+#define ARENA_MAX_BLOCK (1024 * 1024)
+#define ARENA_ALIGN (sizeof(void *))
+
+static Arena *ArenaCreate(void) {
+    Arena *arena = malloc(sizeof(Arena));
+    if (!arena)
+        return NULL;
+    arena->Head = NULL;
+    arena->Last = NULL;
+    arena->Backing = NULL;
+    arena->BackingLength = 0;
+    arena->BackingMapped = 0;
+    arena->Refs = 1;
+    arena->FirstBlock = ARENA_MIN_BLOCK;
+    arena->Kept = NULL;
+    arena->KeptCount = 0;
+    arena->KeptCapacity = 0;
+#ifdef CFG_STATS
+    memset(&arena->Stats, 0, sizeof(ConfigStats));
+#endif
+    return arena;
+}
+
+static int ArenaAddBlock(Arena *arena, size_t size) {
+    // Blocks double in size as the config grows, up to ARENA_MAX_BLOCK
+    size_t want = arena->Head ? arena->Head->Size * 2 : arena->FirstBlock;
+    if (want > ARENA_MAX_BLOCK)
+        want = ARENA_MAX_BLOCK;
+    if (want < size)
+        want = size;
+
+#ifdef CFG_STATS
+    ConfigStats *stats = &arena->Stats;
+    uint64_t start = StatNow();
+    ArenaBlock *block = malloc(sizeof(ArenaBlock) + want);
+    STAT_ADD(AllocateNanos, StatNow() - start);
+#else
+    ArenaBlock *block = malloc(sizeof(ArenaBlock) + want);
+#endif
+    if (!block)
+        return -1;
+    block->Next = arena->Head;
+    block->Size = want;
+    block->Used = 0;
+    arena->Head = block;
+    return 1;
+}
+
+static void *ArenaAlloc(Arena *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+#ifdef CFG_STATS
+    ConfigStats *stats = &arena->Stats;
+    STAT_ADD(Allocations, 1);
+    STAT_ADD(AllocatedBytes, size);
+#endif
+    ArenaBlock *block = arena->Head;
+    if (!block || block->Size - block->Used < size) {
+        if (ArenaAddBlock(arena, size) < 0)
+            return NULL;
+        block = arena->Head;
+    }
+
+    void *ptr = block->Data + block->Used;
+    block->Used += size;
+    arena->Last = ptr;
+    return ptr;
+}
+
+static void *ArenaRealloc(Arena *arena, void *ptr, size_t old, size_t size) {
+    // Grow in place when 'ptr' is the tip of the current block,
+    // otherwise move it. The old copy stays until the arena is freed
+    ArenaBlock *block = arena->Head;
+    if (ptr && ptr == arena->Last) {
+        size_t offset = (char *)ptr - block->Data;
+        size_t need = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+        if (block->Size - offset >= need) {
+            block->Used = offset + need;
+            return ptr;
+        }
+    }
+
+    void *moved = ArenaAlloc(arena, size);
+    if (moved && ptr)
+        memcpy(moved, ptr, old < size ? old : size);
+    return moved;
+}
+
+static void ArenaShrink(Arena *arena, void *ptr, size_t size) {
+    // Hand the tail of 'ptr' back, which again only works for the tip
+    if (ptr && ptr == arena->Last) {
+        ArenaBlock *block = arena->Head;
+        size_t offset = (char *)ptr - block->Data;
+        block->Used = offset + ((size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1));
+    }
+}
+
+static void ArenaRetain(Arena *arena) {
+    __atomic_add_fetch(&arena->Refs, 1, __ATOMIC_RELAXED);
+}
+
+static void ArenaRelease(Arena *arena) {
+    if (!arena || __atomic_sub_fetch(&arena->Refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    for (uint32_t i = 0; i < arena->KeptCount; i++)
+        ArenaRelease(arena->Kept[i]);
+    free(arena->Kept);
+
+    ArenaBlock *block = arena->Head;
+    while (block) {
+        ArenaBlock *next = block->Next;
+        free(block);
+        block = next;
+    }
+
+    if (arena->Backing) {
+        if (arena->BackingMapped)
+            munmap(arena->Backing, arena->BackingLength);
+        else
+            free(arena->Backing);
+    }
+    free(arena);
+}
+
+static int ArenaKeep(Arena *arena, Arena *other) {
+    // Keep 'other' alive for as long as 'arena' is. Only a handful of
+    // arenas are ever kept, so a linear scan deduplicates well enough
+    if (other == arena)
+        return 1;
+    for (uint32_t i = 0; i < arena->KeptCount; i++) {
+        if (arena->Kept[i] == other)
+            return 1;
+    }
+
+    if (arena->KeptCount == arena->KeptCapacity) {
+        uint32_t capacity = arena->KeptCapacity ? arena->KeptCapacity * 2 : 4;
+        Arena **kept = realloc(arena->Kept, capacity * sizeof(Arena *));
+        if (!kept)
+            return -1;
+        arena->Kept = kept;
+        arena->KeptCapacity = capacity;
+    }
+
+    ArenaRetain(other);
+    arena->Kept[arena->KeptCount++] = other;
+    return 1;
+}
+
+// Hash of a whole config line, see ConfigEntry::SourceHash. Never 0, so
+// that 0 can mean "unknown"
+static uint64_t HashSpan(const char *data, size_t len) {
+    uint64_t hash = 0x9e3779b97f4a7c15ULL ^ len;
+    while (len >= 8) {
+        uint64_t word;
+        memcpy(&word, data, 8);
+        hash = (hash ^ word) * 0xff51afd7ed558ccdULL;
+        hash ^= hash >> 32;
+        data += 8;
+        len -= 8;
+    }
+
+    uint64_t tail = 0;
+    memcpy(&tail, data, len);
+    hash = (hash ^ tail) * 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 29;
+    return hash | 1;
+}
+
+// 64-bit FNV-1a, used for ConfigEntry::Hash and the Config::Index. Only
+// configs from EmbedConfig() have a seed, see Config::HashSeed
+static uint64_t HashKeySeeded(const char *key, size_t len, uint64_t seed) {
+    uint64_t hash = 0xcbf29ce484222325ULL ^ seed;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static uint64_t HashKey(const char *key, size_t len) {
+    return HashKeySeeded(key, len, 0);
+}
 
 /* Syntax for the grammar:
+ * <cfg> ::= <comment> | <config_line> | <include>
  * <config_line> ::= <string> "=" <value> ";" | <string> "=" <array> ";"
+ *                 | <string> "=" <table> ";"
+ * <include> ::= "include" <quoted_string> ";"
+ * <table> ::= "{" <cfg>* "}"
  * <array> ::= "[" <value> ( "," <value> )* "]"
  * <value> ::= <quoted_string> | <number> | <decimal>
  * <quoted_string> ::= "'" <atoms>+ "'"
@@ -21,194 +282,568 @@
  * 2) <EOF> signifies the end of file
  */
 
-static void ParseComment(FILE *file) {
+// Token kinds. Punctuation ('=', ';', '[', ']', ',') and any other stray
+// character is returned as a token whose kind is the character itself
+#define TOKEN_EOF (-1)
+#define TOKEN_STRING (256)        // <string>
+#define TOKEN_NUMBER (257)        // <number> | <decimal>, unconverted
+#define TOKEN_QUOTED_STRING (258) // <quoted_string>, without the quotes
+#define TOKEN_COMMENT (259)       // <comment>
+#define TOKEN_UNTERMINATED (260)  // <quoted_string> that runs into <EOF>
+
+typedef struct Token {
+    int Kind;
+    const char *Start;
+    size_t Length;
+} Token;
+
+// The lexer walks the input exactly once, front to back. Tokens are spans
+// into the input, so nothing is read twice and nothing is copied here
+typedef struct Lexer {
+    const char *Cursor;
+    const char *End;
+    const char *Begin; // of the whole input, for positions in errors
+} Lexer;
+
+// What ReparseConfig() diffs against, and whom it tells about changes
+typedef struct Reparse {
+    Config *Old;
+    ConfigChangeFn OnChange;
+    void *Userdata;
+} Reparse;
+
+typedef struct SchemaKey {
+    char *Key;
+    size_t Length;
+    uint64_t Hash;
+    int Type; // PRIMITIVE_TYPE or ARRAY_TYPE
+    int ValueType; // of the primitive or of every element, NULL_TYPE: any
+    int Flags; // SCHEMA_* flags
+    double Min, Max; // numeric range, if SCHEMA_RANGE
+} SchemaKey;
+
+// A ConfigSchema is an open addressed table over its keys, like the
+// Config::Index, so the parser can consult it on every config line
+struct ConfigSchema {
+    SchemaKey *Keys;
+    uint32_t Count;
+    uint32_t Capacity;
+    uint32_t *Index; // key number + 1, 0 for an empty slot
+    uint64_t IndexMask;
+    int Flags; // SCHEMA_SKIP_UNKNOWN
+};
+
+// How a parse goes, from the public entry points down to ParseInput()
+typedef struct ParseOptions {
+    int Flags; // PARSE_* flags
+    Reparse *Reparse; // NULL unless reparsing
+    int Threads; // 1 unless parsing in parallel
+    const ConfigSchema *Schema; // NULL unless validating
+    IncludeCache *Cache; // NULL to parse every included file afresh
+    const char *Path; // of the file being parsed, NULL for buffers
+    int Depth; // of include directives leading here, 0 at the top
+    struct FileStamps *Stamps; // collects the files included, if non-NULL
+    ParserContext *Context; // where failures are recorded, may be NULL
+    const struct Config *Base; // of the overlay being parsed, else NULL
+} ParseOptions;
+
+// What the parses made with one context have in common. Everything else
+// a parse needs lives in its Parser on the stack, so parses share nothing
+struct ParserContext {
+    int Status; // of the last parse, 0 while it runs
+    char *File; // the failure happened in, NULL for buffers
+    size_t Offset;
+    uint32_t Line;
+    uint32_t Column;
+    char *Buffer; // input of the last parse, reused by the next one
+    size_t Capacity;
+};
+
+// The parser keeps exactly one token of lookahead in 'Tok'
+typedef struct Parser {
+    Lexer Lex;
+    Token Tok;
+    Arena *Arena; // where the nodes of the Config being built come from
+    int Flags; // PARSE_* flags
+    Reparse *Reparse; // NULL unless reparsing
+    Arena *Owner; // the Config's own arena, which keeps 'Arena' alive
+    const ConfigSchema *Schema; // NULL unless validating
+    const ParseOptions *Options; // for include directives
+    uint32_t Includes; // include directives seen
+} Parser;
+
+/* Character classes of the lexer. Unlike <ctype.h> they never depend on
+ * the locale, and testing one is a single table load
+ */
+#define CHAR_SPACE (1 << 0)
+#define CHAR_ALPHA (1 << 1)  // <letter>
+#define CHAR_DIGIT (1 << 2)  // <digit>
+#define CHAR_HEX (1 << 3)    // a-f, A-F
+#define CHAR_SYMBOL (1 << 4) // <symbol>: $ . _
+#define CHAR_IDENT (CHAR_ALPHA | CHAR_DIGIT | CHAR_SYMBOL)
+
+static const unsigned char CharClass[256] = {
+    ['\t'] = CHAR_SPACE, ['\n'] = CHAR_SPACE, ['\v'] = CHAR_SPACE,
+    ['\f'] = CHAR_SPACE, ['\r'] = CHAR_SPACE, [' '] = CHAR_SPACE,
+    ['0' ... '9'] = CHAR_DIGIT,
+    ['a' ... 'f'] = CHAR_ALPHA | CHAR_HEX, ['g' ... 'z'] = CHAR_ALPHA,
+    ['A' ... 'F'] = CHAR_ALPHA | CHAR_HEX, ['G' ... 'Z'] = CHAR_ALPHA,
+    ['$'] = CHAR_SYMBOL, ['.'] = CHAR_SYMBOL, ['_'] = CHAR_SYMBOL,
+};
+
+static int IsClass(unsigned char c, int cls) { return CharClass[c] & cls; }
+
+/* Runs of whitespace and of <string> characters are measured 16 bytes at
+ * a time where the target has vector instructions for it, SSE2 on x86-64
+ * and NEON on AArch64 are always there. SpaceRun() and IdentRun() return
+ * how many of the 16 bytes at 'p' belong to the run before it ends.
+ * Scanning to the end of a comment or a quoted string is memchr()'s job,
+ * which libc already vectorises with the widest instructions the CPU has
+ */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define SCAN_WIDTH 16
+
+static unsigned FirstUnset(__m128i in) {
+    unsigned miss = ~(unsigned)_mm_movemask_epi8(in) & 0xffff;
+    return miss ? (unsigned)__builtin_ctz(miss) : SCAN_WIDTH;
+}
+
+static __m128i InRange(__m128i v, char lo, char hi) {
+    // Signed compares, so bytes >= 0x80 are never in range
+    return _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8(lo - 1)),
+                         _mm_cmplt_epi8(v, _mm_set1_epi8(hi + 1)));
+}
+
+static unsigned SpaceRun(const char *p) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i in = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')),
+                              InRange(v, '\t', '\r'));
+    return FirstUnset(in);
+}
+
+static unsigned IdentRun(const char *p) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    __m128i lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+    __m128i in = _mm_or_si128(InRange(lower, 'a', 'z'), InRange(v, '0', '9'));
+    in = _mm_or_si128(in, _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+    in = _mm_or_si128(in, _mm_cmpeq_epi8(v, _mm_set1_epi8('.')));
+    in = _mm_or_si128(in, _mm_cmpeq_epi8(v, _mm_set1_epi8('$')));
+    return FirstUnset(in);
+}
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define SCAN_WIDTH 16
+
+static unsigned FirstUnset(uint8x16_t in) {
+    // Narrow to one nibble per byte, there is no movemask
+    uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(in), 4);
+    uint64_t miss = ~vget_lane_u64(vreinterpret_u64_u8(nibbles), 0);
+    return miss ? (unsigned)__builtin_ctzll(miss) / 4 : SCAN_WIDTH;
+}
+
+static uint8x16_t InRange(uint8x16_t v, char lo, char hi) {
+    return vandq_u8(vcgeq_u8(v, vdupq_n_u8(lo)), vcleq_u8(v, vdupq_n_u8(hi)));
+}
+
+static unsigned SpaceRun(const char *p) {
+    uint8x16_t v = vld1q_u8((const uint8_t *)p);
+    uint8x16_t in = vorrq_u8(vceqq_u8(v, vdupq_n_u8(' ')),
+                             InRange(v, '\t', '\r'));
+    return FirstUnset(in);
+}
+
+static unsigned IdentRun(const char *p) {
+    uint8x16_t v = vld1q_u8((const uint8_t *)p);
+    uint8x16_t lower = vorrq_u8(v, vdupq_n_u8(0x20));
+    uint8x16_t in = vorrq_u8(InRange(lower, 'a', 'z'), InRange(v, '0', '9'));
+    in = vorrq_u8(in, vceqq_u8(v, vdupq_n_u8('_')));
+    in = vorrq_u8(in, vceqq_u8(v, vdupq_n_u8('.')));
+    in = vorrq_u8(in, vceqq_u8(v, vdupq_n_u8('$')));
+    return FirstUnset(in);
+}
+#endif
+
+// End of the run of CHAR_SPACE or CHAR_IDENT characters at 'p'
+static const char *SkipClass(const char *p, const char *end, int cls) {
+#ifdef SCAN_WIDTH
+    while (end - p >= SCAN_WIDTH) {
+        unsigned n = cls == CHAR_SPACE ? SpaceRun(p) : IdentRun(p);
+        p += n;
+        if (n < SCAN_WIDTH)
+            return p;
+    }
+#endif
+    while (p < end && IsClass(*p, cls))
+        p++;
+    return p;
+}
+
+static void LexComment(Lexer *lex) {
     // The '#' has already been consumed
     // keep consuming everything until you see a newline or EOF
     // <comment> ::= "#" (anything)* ("\n" | <EOF>)
-    while (1) {
-        int c = fgetc(file);
-        if (c == '\n' || c == EOF)
+    const char *nl = memchr(lex->Cursor, '\n', lex->End - lex->Cursor);
+    lex->Cursor = nl ? nl + 1 : lex->End;
+}
+
+static void LexString(Lexer *lex) {
+    // <string> ::= <letter> (<letter>|<digit>|<symbol>)
+    // The leading <letter> has already been consumed
+    lex->Cursor = SkipClass(lex->Cursor, lex->End, CHAR_IDENT);
+}
+
+static int LexQuotedString(Lexer *lex) {
+    // The opening ''' has already been consumed
+    const char *quote = memchr(lex->Cursor, '\'', lex->End - lex->Cursor);
+    if (!quote) {
+        lex->Cursor = lex->End;
+        return TOKEN_UNTERMINATED;
+    }
+    lex->Cursor = quote + 1;
+    return TOKEN_QUOTED_STRING;
+}
+
+static void LexGenericNumber(Lexer *lex) {
+    // <number>  ::= <digit>+
+    // <decimal> ::= <digit>+ '.' <digit>+
+    // <generic_number> ::= <number> | <decimal>
+    // The leading <digit> has already been consumed
+    int first_dot = 1;
+    while (lex->Cursor < lex->End) {
+        unsigned char ch = *lex->Cursor;
+        if (IsClass(ch, CHAR_DIGIT | CHAR_HEX) || ch == 'x' || ch == 'X')
+            ;
+        else if (ch == '.' && first_dot)
+            first_dot = 0;
+        else
             break;
+        lex->Cursor++;
     }
 }
 
-static int IsSpecialSymbol(int c) {
-    switch (c) {
-    case '$':
-    case '.':
-    case '_':
-        return 1;
-    default:
-        return 0;
+static void LexToken(Parser *p) {
+    // Move on to the next token, skipping whitespace in front of it
+    Lexer *lex = &p->Lex;
+    Token *tok = &p->Tok;
+    // Tokens are mostly a single space apart, don't load 16 bytes for that
+    if (lex->Cursor < lex->End && IsClass(*lex->Cursor, CHAR_SPACE)) {
+        lex->Cursor++;
+        if (lex->Cursor < lex->End && IsClass(*lex->Cursor, CHAR_SPACE))
+            lex->Cursor = SkipClass(lex->Cursor, lex->End, CHAR_SPACE);
+    }
+
+    tok->Start = lex->Cursor;
+    if (lex->Cursor == lex->End) {
+        tok->Kind = TOKEN_EOF;
+        tok->Length = 0;
+        return;
+    }
+
+    unsigned char c = *lex->Cursor++;
+    if (c == '#') {
+        tok->Kind = TOKEN_COMMENT;
+        LexComment(lex);
+    } else if (c == '\'') {
+        tok->Kind = LexQuotedString(lex);
+        if (tok->Kind == TOKEN_QUOTED_STRING) {
+            // Hand out the contents only, without the quotes
+            tok->Start++;
+            tok->Length = lex->Cursor - tok->Start - 1;
+            return;
+        }
+    } else if (IsClass(c, CHAR_ALPHA)) {
+        tok->Kind = TOKEN_STRING;
+        LexString(lex);
+    } else if (IsClass(c, CHAR_DIGIT)) {
+        tok->Kind = TOKEN_NUMBER;
+        LexGenericNumber(lex);
+    } else {
+        tok->Kind = c;
     }
+
+    tok->Length = lex->Cursor - tok->Start;
 }
 
-static int expect(FILE *file, int c) {
-    int ch = fgetc(file);
-    if (c != ch)
-        return -1;
-    return 1;
+static void advance(Parser *p) {
+#ifdef CFG_STATS
+    // Streaming has no arena, and counts nothing
+    if (p->Arena) {
+        ConfigStats *stats = &p->Arena->Stats;
+        uint64_t start = StatNow();
+        LexToken(p);
+        STAT_ADD(LexNanos, StatNow() - start);
+        return;
+    }
+#endif
+    LexToken(p);
 }
 
-static int consumeLetter(FILE *file) {
-    int c = fgetc(file);
-    if (!isalpha(c))
+static int expect(Parser *p, int kind) {
+    if (p->Tok.Kind != kind)
         return -1;
+    advance(p);
     return 1;
 }
 
-static void consumeSpace(FILE *file) {
-    while (1) {
-        int c = fgetc(file);
-        if (!isspace(c)) {
-            pushback(file, 1);
-            break;
-        }
+// Record a failure at 'at' (NULL if it has no position) in the context
+// of 'p', unless a parse of a file included from here got there first
+static void NoteError(Parser *p, const char *at, int status) {
+    ParserContext *ctx = p->Options ? p->Options->Context : NULL;
+    if (!ctx || ctx->Status < 0)
+        return;
+    ctx->Status = status;
+    ctx->File = p->Options->Path ? strdup(p->Options->Path) : NULL;
+    if (!at)
+        return;
+
+    // Only ever done once per parse, so just count
+    const char *line = p->Lex.Begin, *nl;
+    uint32_t lines = 1;
+    while ((nl = memchr(line, '\n', (size_t)(at - line)))) {
+        line = nl + 1;
+        lines++;
     }
+    ctx->Offset = (size_t)(at - p->Lex.Begin);
+    ctx->Line = lines;
+    ctx->Column = (uint32_t)(at - line) + 1;
 }
 
-static char* ParseString(FILE *file) {
-    // <string> ::= <letter> (<letter>|<digit>|<symbol>)
-    int len = 0;
-    if (consumeLetter(file) < 0)
+static char *CopySpan(Parser *p, const Token *tok) {
+    // With PARSE_ZERO_COPY the token itself is the string
+    if (p->Flags & PARSE_ZERO_COPY)
+        return (char *)tok->Start;
+
+    char *string = ArenaAlloc(p->Arena, sizeof(char) * (tok->Length + 1));
+    if (!string)
         return NULL;
-    len++;
+    memcpy(string, tok->Start, tok->Length);
+    string[tok->Length] = '\0';
+    return string;
+}
 
-    while (1) {
-        int c = fgetc(file);
-        if (!isalnum(c) && !IsSpecialSymbol(c)) {
-            pushback(file, 1);
-            break;
-        }
+/* Numeric literals are converted straight from the token span, without
+ * the locale and without copying. Integers are accumulated with overflow
+ * checks, following strtol()'s base 0 rules: "0x" is hex, a leading 0
+ * is octal. Decimals with up to 19 significant digits and a small enough
+ * exponent are exact as one multiplication or division of doubles
+ * (Clinger's fast path). Anything else goes to strtod_l() in the "C"
+ * locale, which rounds correctly
+ */
+static int DigitValue(unsigned char c) {
+    if (IsClass(c, CHAR_DIGIT))
+        return c - '0';
+    if (IsClass(c, CHAR_HEX))
+        return (c | 0x20) - 'a' + 10;
+    return 99;
+}
 
-        len++;
+static int ConvertInteger(const char *s, size_t len, int64_t *result) {
+    unsigned base = 10;
+    if (len > 1 && s[0] == '0') {
+        base = 8;
+        s++, len--;
+        if (*s == 'x' || *s == 'X') {
+            base = 16;
+            s++, len--;
+            if (len == 0)
+                return INVALID_INTEGER_LITERAL;
+        }
     }
 
-    pushback(file, len);
-    char *string = malloc(sizeof(char) * (len + 1));
-    fgets(string, len + 1, file);
-    string[len] = '\0';
-
-    return string;
+    uint64_t n = 0;
+    for (size_t i = 0; i < len; i++) {
+        unsigned d = (unsigned)DigitValue((unsigned char)s[i]);
+        if (d >= base || n > ((uint64_t)INT64_MAX - d) / base)
+            return INVALID_INTEGER_LITERAL;
+        n = n * base + d;
+    }
+    *result = (int64_t)n;
+    return 1;
 }
 
-static int ParseQuotedString(FILE *file, PrimitiveValue *value) {
-    int len = 0;
-    while (1) {
-        int ch = fgetc(file);
-        if (ch == EOF)
-            return UNEXPECTED_EOF;
+static locale_t CLocale;
+static pthread_once_t CLocaleOnce = PTHREAD_ONCE_INIT;
 
-        if (ch == '\'')
-            break;
+static void InitCLocale(void) { CLocale = newlocale(LC_ALL_MASK, "C", 0); }
+
+static int ConvertDecimalSlow(const char *s, size_t len, double *result) {
+    // Numeric literals are short enough to copy onto the stack in all but
+    // pathological cases
+    char buf[64];
+    char *str = buf;
+    if (len >= sizeof(buf) && !(str = malloc(len + 1)))
+        return OUT_OF_MEMORY;
+    memcpy(str, s, len);
+    str[len] = '\0';
 
-        len += 1;
+    int status = OUT_OF_MEMORY;
+    pthread_once(&CLocaleOnce, InitCLocale);
+    if (CLocale) {
+        char *endptr;
+        *result = strtod_l(str, &endptr, CLocale);
+        status = *endptr == '\0' ? 1 : INVALID_DECIMAL_LITERAL;
     }
 
-    pushback(file, len + 1); // putback the ''' too
-    value->String = malloc(sizeof(char) * (len + 1));
-    fgets(value->String, len + 1, file);
-    value->String[len] = '\0';
-    fgetc(file); // remove the last '''
-    return 1;
+    if (str != buf)
+        free(str);
+    return status;
 }
 
-static int IsHexDigit(int c) {
-    switch (tolower(c)) {
-        case 'a' : case 'b' : case 'c':
-        case 'd' : case 'e' : case 'f': return 1;
-        default: return 0;
+static int ConvertDecimal(const char *s, size_t len, double *result) {
+    // <digit>+ "." <digit>* (("e" | "E") <digit>+)?
+    static const double Pow10[] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+    };
+    const char *p = s, *end = s + len;
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    for (; p < end && IsClass(*p, CHAR_DIGIT); p++) {
+        if (digits || *p != '0')
+            digits++;
+        mantissa = mantissa * 10 + (uint64_t)(*p - '0');
     }
-}
-
-static int ParseGenericNumber(FILE *file, PrimitiveValue *value) {
-    // <number>  ::= <digit>+
-    // <decimal> ::= <digit>+ '.' <digit>+
-    // <generic_number> ::= <number> | <decimal>
-    int len = 0, first_dot = 1, is_float = 0;
-    while (1) {
-        int ch = fgetc(file);
-        if (ch == EOF) 
-            return UNEXPECTED_TOKEN;
-
-        if (isdigit(ch) || IsHexDigit(ch) || ch == 'x' || ch == 'X') 
-            len++;
-        else if (ch == '.' && first_dot) {
-            len++;
-            is_float = 1;
-            first_dot = 0;
-        }
-        else {
-            pushback(file, 1);
-            break;
+    if (p < end && *p == '.') {
+        for (p++; p < end && IsClass(*p, CHAR_DIGIT); p++) {
+            if (digits || *p != '0')
+                digits++;
+            mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+            exponent--;
         }
     }
+    if (p < end && (*p == 'e' || *p == 'E') && end - p > 1 && end - p <= 4) {
+        int e = 0;
+        for (p++; p < end && IsClass(*p, CHAR_DIGIT); p++)
+            e = e * 10 + (*p - '0');
+        exponent += e;
+    }
 
-    pushback(file, len);
-    char* str = malloc(sizeof(char) * (len + 1));
-    fgets(str, len + 1, file);
-    str[len] = '\0';
+    if (p != end || digits > 19 || mantissa > (1ULL << 53) ||
+        exponent < -22 || exponent > 22)
+        return ConvertDecimalSlow(s, len, result);
+
+    double d = (double)mantissa;
+    *result = exponent < 0 ? d / Pow10[-exponent] : d * Pow10[exponent];
+    return 1;
+}
 
-    if (is_float) {
+static int ConvertGenericNumber(const Token *tok, PrimitiveValue *value) {
+    if (memchr(tok->Start, '.', tok->Length)) {
         value->Type = DECIMAL_TYPE;
-        char* endptr = "";
-        value->Decimal = strtod(str, &endptr);
-        if (*endptr != '\0')
-            return INVALID_DECIMAL_LITERAL;
+        return ConvertDecimal(tok->Start, tok->Length, &value->Decimal);
     }
-    else {
-        value->Type = NUMBER_TYPE;
-        char* endptr = "";
-        value->Number = strtol(str, &endptr, 0);
-        if (*endptr != '\0')
-            return INVALID_INTEGER_LITERAL;
-    }
-
-    free(str);
-    return 1; 
+    value->Type = NUMBER_TYPE;
+    return ConvertInteger(tok->Start, tok->Length, &value->Number);
 }
 
-static int ParseValue(FILE *file, Value *value) {
+static int ParsePrimitive(Parser *p, PrimitiveValue *value) {
     // <value> = <generic_number> | <decimal> | <quoted_string>
     // At this point we are already pointing at some token
-    int ch = fgetc(file);
-    if (ch == EOF)
+    Token tok = p->Tok;
+    if (tok.Kind == TOKEN_EOF || tok.Kind == TOKEN_UNTERMINATED)
         return UNEXPECTED_EOF;
 
-    value->Primitive = malloc(sizeof(PrimitiveValue));
-
-    if (ch == '\'') {
-        value->Primitive->Type = STRING_TYPE;
-        return ParseQuotedString(file, value->Primitive);
+    if (tok.Kind == TOKEN_QUOTED_STRING) {
+        if (tok.Length > UINT32_MAX)
+            return UNEXPECTED_TOKEN;
+        value->Type = STRING_TYPE;
+        value->Length = (uint32_t)tok.Length;
+        value->String = CopySpan(p, &tok);
+        if (!value->String)
+            return OUT_OF_MEMORY;
+        advance(p);
+        return 1;
     }
 
-    else if (isdigit(ch)) {
-        pushback(file, 1);
-        return ParseGenericNumber(file, value->Primitive);
+    else if (tok.Kind == TOKEN_NUMBER) {
+        // Stay at a literal that does not convert, for the error position
+        int status;
+#ifdef CFG_STATS
+        if (p->Arena) {
+            ConfigStats *stats = &p->Arena->Stats;
+            uint64_t start = StatNow();
+            status = ConvertGenericNumber(&tok, value);
+            STAT_ADD(ConvertNanos, StatNow() - start);
+        } else
+#endif
+        status = ConvertGenericNumber(&tok, value);
+        if (status > 0)
+            advance(p);
+        return status;
     }
 
     return UNEXPECTED_TOKEN;
 }
 
-static int ParseVector(FILE *file, Value *entry) {
+static int ParseValue(Parser *p, Value *value) {
+    value->Primitive = ArenaAlloc(p->Arena, sizeof(PrimitiveValue));
+    if (!value->Primitive)
+        return OUT_OF_MEMORY;
+    return ParsePrimitive(p, value->Primitive);
+}
+
+static int FlattenVector(Parser *p, Vector *vec) {
+    // Give homogeneous numeric vectors a plain array of their own as well
+    vec->ElementType = vec->Length ? vec->Data[0].Type : NULL_TYPE;
+    for (uint64_t i = 1; i < vec->Length; i++) {
+        if (vec->Data[i].Type != vec->ElementType) {
+            vec->ElementType = NULL_TYPE;
+            break;
+        }
+    }
+
+    vec->Numbers = NULL;
+    if (vec->ElementType == NUMBER_TYPE) {
+        vec->Numbers = ArenaAlloc(p->Arena, vec->Length * sizeof(int64_t));
+        if (!vec->Numbers)
+            return OUT_OF_MEMORY;
+        for (uint64_t i = 0; i < vec->Length; i++)
+            vec->Numbers[i] = vec->Data[i].Number;
+    }
+
+    else if (vec->ElementType == DECIMAL_TYPE) {
+        vec->Decimals = ArenaAlloc(p->Arena, vec->Length * sizeof(double));
+        if (!vec->Decimals)
+            return OUT_OF_MEMORY;
+        for (uint64_t i = 0; i < vec->Length; i++)
+            vec->Decimals[i] = vec->Data[i].Decimal;
+    }
+
+    return 1;
+}
+
+static int ParseVector(Parser *p, Value *entry) {
     // vector ::= '[' <value> (',' <value>)* ']'
-    entry->Array = malloc(sizeof(Vector));
+    // The '[' has already been consumed
+    entry->Array = ArenaAlloc(p->Arena, sizeof(Vector));
     Vector *vec = entry->Array;
-    vec->Data = malloc(sizeof(Value *) * 1);
+    if (!vec)
+        return OUT_OF_MEMORY;
 
+    vec->Data = NULL;
     vec->Length = 0;
+    vec->Capacity = 0;
     int more = 1;
     while (1) {
-        consumeSpace(file);
-        int ch = fgetc(file);
+        int kind = p->Tok.Kind;
 
-        if (ch == EOF)
+        if (kind == TOKEN_EOF)
             return UNEXPECTED_EOF;
 
-        else if (ch == ']')
+        else if (kind == ']') {
+            advance(p);
+            // Give back whatever the last growth step over-allocated
+            if (vec->Data == p->Arena->Last) {
+                ArenaShrink(p->Arena, vec->Data,
+                            vec->Length * sizeof(PrimitiveValue));
+                vec->Capacity = vec->Length;
+            }
             break;
+        }
 
-        else if (ch == ',') {
+        else if (kind == ',') {
+            advance(p);
             more = 1;
             continue;
         }
@@ -216,245 +851,3782 @@ static int ParseVector(FILE *file, Value *entry) {
         if (!more)
             return UNEXPECTED_TOKEN;
 
-        vec->Length++;
-        pushback(file, 1);
-
-        if (vec->Length == 1) {
-            // Already allocated for us
-            vec->Data[0] = malloc(sizeof(Value));
-            if (ParseValue(file, vec->Data[0]) < 0)
-                return INVALID_ARRAY_ELEMENT;
+        if (vec->Length == vec->Capacity) {
+            // Grow geometrically, so appending stays amortised O(1)
+            uint64_t capacity = vec->Capacity ? vec->Capacity * 2 : 4;
+            vec->Data = ArenaRealloc(p->Arena, vec->Data,
+                                     vec->Length * sizeof(PrimitiveValue),
+                                     capacity * sizeof(PrimitiveValue));
+            if (!vec->Data)
+                return OUT_OF_MEMORY;
+            vec->Capacity = capacity;
         }
 
-        else {
-            vec->Data = realloc(vec->Data, vec->Length * sizeof(Value*));
-            vec->Data[vec->Length - 1] = malloc(sizeof(Value));
-            if (ParseValue(file, vec->Data[vec->Length - 1]) < 0)
-                return INVALID_ARRAY_ELEMENT;
-        }
+        vec->Length++;
+        int status = ParsePrimitive(p, &vec->Data[vec->Length - 1]);
+        if (status == OUT_OF_MEMORY)
+            return status;
+        if (status < 0)
+            return INVALID_ARRAY_ELEMENT;
 
         more = 0;
     }
 
-    return 1;
+#ifdef CFG_STATS
+    ConfigStats *stats = &p->Arena->Stats;
+    STAT_ADD(ArrayElements, vec->Length);
+#endif
+    return FlattenVector(p, vec);
 }
 
-static int ParseConfigLine(FILE *file, ConfigEntry *entry) {
-    // <config_line> ::= <string> "=" (<array> | <value>) ";"
-    entry->Key = ParseString(file);
-    if (!entry->Key)
+static int ParseTable(Parser *p, Value *value);
+
+static int ParseConfigLine(Parser *p, ConfigEntry *entry) {
+    // <config_line> ::= <string> "=" (<array> | <value> | <table>) ";"
+    const char *start = p->Tok.Start;
+    if (p->Tok.Kind != TOKEN_STRING || p->Tok.Length > UINT32_MAX)
         return INVALID_CONFIG_KEY;
+    entry->KeyLength = (uint32_t)p->Tok.Length;
+    entry->Key = CopySpan(p, &p->Tok);
+    if (!entry->Key)
+        return OUT_OF_MEMORY;
+    entry->Hash = HashKey(p->Tok.Start, p->Tok.Length);
+    advance(p);
 
-    consumeSpace(file);
-    if (expect(file, '=') < 0)
+    if (expect(p, '=') < 0)
         return UNEXPECTED_TOKEN;
 
-    consumeSpace(file);
-
-    int ch = fgetc(file);
-    if (ch == EOF)
+    if (p->Tok.Kind == TOKEN_EOF)
         return UNEXPECTED_EOF;
 
     int status = 0;
 
-    entry->Value = malloc(sizeof(Value));
-    if (ch == '[') {
+    entry->Value = ArenaAlloc(p->Arena, sizeof(Value));
+    if (!entry->Value)
+        return OUT_OF_MEMORY;
+    if (p->Tok.Kind == '[') {
         entry->Type = ARRAY_TYPE;
-        status = ParseVector(file, entry->Value);
+        advance(p);
+        status = ParseVector(p, entry->Value);
+    } else if (p->Tok.Kind == '{') {
+        entry->Type = TABLE_TYPE;
+        advance(p);
+        status = ParseTable(p, entry->Value);
     } else {
         entry->Type = PRIMITIVE_TYPE;
-        pushback(file, 1);
-        status = ParseValue(file, entry->Value);
+        status = ParseValue(p, entry->Value);
     }
 
-    consumeSpace(file);
+    if (status < 0)
+        return status;
 
-    if (expect(file, ';') < 0)
+    if (p->Tok.Kind != ';')
         return UNEXPECTED_TOKEN;
+    entry->SourceHash = HashSpan(start, p->Tok.Start + 1 - start);
+    advance(p);
 
     return status;
 }
 
-static int ParseCfg(FILE *file, ConfigEntry *entry) {
-    // entry is already allocated for us
-    // we will allocate entry->Next for the next configuration
-    // initialising it with NULL_TYPE, ONLY IF what we are
-    // parsing is an actual configuration
-
-    // <cfg> ::= <empty> | <comment> | <config_line>
-    // <empty> ::= '\n'
+// Entry of 'config' for the config line whose key is 'Key' and whose text
+// hashes to 'source', if any
+static ConfigEntry *FindSource(Config *config, const char *Key, size_t len,
+                               uint64_t hash, uint64_t source) {
+    uint64_t slot = hash & config->IndexMask;
     while (1) {
-        int c = fgetc(file);
-        if (c == EOF)
-            return UNEXPECTED_EOF;
+        ConfigEntry *ce = config->Index[slot];
+        if (!ce)
+            return NULL;
+        if (ce->SourceHash == source && ce->Hash == hash &&
+            ce->KeyLength == len && memcmp(ce->Key, Key, len) == 0)
+            return ce;
+        slot = (slot + 1) & config->IndexMask;
+    }
+}
 
-        if (c == '\n')
-            return 1;
+// Whether the parser is at an <include>. Only "include" followed by a
+// <quoted_string> is one, so "include" still works as a key
+static int AtInclude(Parser *p) {
+    if (p->Tok.Length != 7 || memcmp(p->Tok.Start, "include", 7) != 0)
+        return 0;
+    Lexer saved = p->Lex;
+    Token tok = p->Tok;
+    advance(p);
+    int kind = p->Tok.Kind;
+    p->Lex = saved;
+    p->Tok = tok;
+    return kind == TOKEN_QUOTED_STRING;
+}
 
-        if (isspace(c))
-            continue;
+/* A line reused by a reparse is copied into the new arena rather than
+ * linked to. Linking kept the old arena alive, and through it every one
+ * before, so a Config reloaded again and again held all its generations
+ */
+static int BuildIndex(Config *config);
 
-        if (c == '#') {
-            ParseComment(file);
-            return 1;
-        }
+static char *CopyText(Parser *p, const char *s, size_t len) {
+    char *string = ArenaAlloc(p->Arena, sizeof(char) * (len + 1));
+    if (!string)
+        return NULL;
+    memcpy(string, s, len);
+    string[len] = '\0';
+    return string;
+}
 
-        if (isalpha(c)) {
-            pushback(file, 1);
-            int status = ParseConfigLine(file, entry);
-            if (status < 0)
-                return status;
-            break;
-        }
+static int CopyValueNode(Parser *p, PrimitiveValue *to,
+                         const PrimitiveValue *from) {
+    *to = *from;
+    if (from->Type == STRING_TYPE &&
+        !(to->String = CopyText(p, from->String, from->Length)))
+        return OUT_OF_MEMORY;
+    return 1;
+}
 
-        return UNEXPECTED_TOKEN;
+static int CopyVectorNode(Parser *p, Vector *to, const Vector *from) {
+    to->Length = from->Length;
+    to->Capacity = from->Length;
+    to->Data = NULL;
+    if (from->Length) {
+        to->Data = ArenaAlloc(p->Arena, from->Length * sizeof(PrimitiveValue));
+        if (!to->Data)
+            return OUT_OF_MEMORY;
     }
-
-    // We came here after successfully parsing a config_line
-    entry->Next = malloc(sizeof(ConfigEntry));
-    entry->Next->Type = NULL_TYPE;
-    entry->Next->Next = NULL;
-    return 1;
+    for (uint64_t i = 0; i < from->Length; i++) {
+        if (CopyValueNode(p, &to->Data[i], &from->Data[i]) < 0)
+            return OUT_OF_MEMORY;
+    }
+    return FlattenVector(p, to);
 }
 
-int ParseConfig(const char *name, Config **result) {
-    FILE *file = fopen(name, "r");
-    if (!file)
-        return FILE_NO_ACCESS;
+static int CopyEntryNodes(Parser *p, ConfigEntry *to, const ConfigEntry *from);
 
-    *result = malloc(sizeof(Config));
-    if (!*result) {
-        fclose(file);
+static int CopyTableNode(Parser *p, Value *value, const Config *from) {
+    Config *table = ArenaAlloc(p->Arena, sizeof(Config));
+    if (!table)
         return OUT_OF_MEMORY;
+    memset(table, 0, sizeof(Config));
+    table->Arena = p->Arena;
+    value->Table = table;
+
+    ConfigEntry **tail = &table->List;
+    for (const ConfigEntry *ce = from->List; ce; ce = ce->Next) {
+        ConfigEntry *copy = ArenaAlloc(p->Arena, sizeof(ConfigEntry));
+        if (!copy)
+            return OUT_OF_MEMORY;
+        int status = CopyEntryNodes(p, copy, ce);
+        if (status < 0)
+            return status;
+        *tail = copy;
+        tail = &copy->Next;
+        table->Entries++;
     }
+    // A composed table only has the winning definitions left in its list
+    return BuildIndex(table);
+}
 
-    Config *config = *result;
-    config->Entries = 0;
-    config->List = malloc(sizeof(ConfigEntry));
-    config->List->Type = NULL_TYPE;
-    config->List->Next = NULL;
+static int CopyEntryNodes(Parser *p, ConfigEntry *to, const ConfigEntry *from) {
+    // Keys are hashed afresh, 'from' may come from EmbedConfig()
+    *to = *from;
+    to->Next = NULL;
+    to->Owner = p->Owner;
+    to->Hash = HashKey(from->Key, from->KeyLength);
+    to->Key = CopyText(p, from->Key, from->KeyLength);
+    to->Value = ArenaAlloc(p->Arena, sizeof(Value));
+    if (!to->Key || !to->Value)
+        return OUT_OF_MEMORY;
+    memset(to->Value, 0, sizeof(Value));
 
-    ConfigEntry *Tail = config->List; // maintain tail for fast access
+    if (from->Type == TABLE_TYPE)
+        return CopyTableNode(p, to->Value, from->Value->Table);
+    if (from->Type == PRIMITIVE_TYPE) {
+        to->Value->Primitive = ArenaAlloc(p->Arena, sizeof(PrimitiveValue));
+        if (!to->Value->Primitive)
+            return OUT_OF_MEMORY;
+        return CopyValueNode(p, to->Value->Primitive, from->Value->Primitive);
+    }
+    to->Value->Array = ArenaAlloc(p->Arena, sizeof(Vector));
+    if (!to->Value->Array)
+        return OUT_OF_MEMORY;
+    return CopyVectorNode(p, to->Value->Array, from->Value->Array);
+}
 
-    while (1) {
-        int c = fgetc(file);
-        // <prog> ::= <EOF>
-        if (c == EOF)
+static int ReuseConfigLine(Parser *p, ConfigEntry **entry) {
+    // Find the end of this <config_line> with the lexer alone. If the
+    // previous Config has an entry for the very same text, copy its key
+    // and value instead of parsing them again. Returns 0 if the line has
+    // to be parsed after all, with the parser rewound to its key. So has
+    // a table holding an <include>, whose file may have changed since
+    Lexer saved = p->Lex;
+    Token key = p->Tok;
+    int depth = 0; // of <table>s, whose lines end in ';' too
+    do {
+        advance(p);
+        if (p->Tok.Kind == '{')
+            depth++;
+        else if (p->Tok.Kind == '}')
+            depth--;
+        else if (depth > 0 && p->Tok.Kind == TOKEN_STRING && AtInclude(p))
             break;
+    } while ((p->Tok.Kind != ';' || depth > 0) && p->Tok.Kind != TOKEN_EOF &&
+             p->Tok.Kind != TOKEN_UNTERMINATED &&
+             (p->Tok.Kind != TOKEN_COMMENT || depth > 0));
 
-        if (isspace(c))
-            continue;
-
-        // <prog> ::= <cfg>
-        pushback(file, 1);
-        int status = ParseCfg(file, Tail);
-        if (status < 0) {
-            free(config);
-            fclose(file);
-            return status;
-        }
-
-        if (Tail->Next) {
-            Tail = Tail->Next;
-            config->Entries++;
+    if (p->Tok.Kind == ';') {
+        uint64_t source = HashSpan(key.Start, p->Tok.Start + 1 - key.Start);
+        ConfigEntry *old = FindSource(p->Reparse->Old, key.Start, key.Length,
+                                      HashKeySeeded(key.Start, key.Length,
+                                                    p->Reparse->Old->HashSeed),
+                                      source);
+        if (old) {
+            ConfigEntry *ce = ArenaAlloc(p->Arena, sizeof(ConfigEntry));
+            if (!ce)
+                return OUT_OF_MEMORY;
+            int status = CopyEntryNodes(p, ce, old);
+            if (status < 0)
+                return status;
+            advance(p);
+            *entry = ce;
+            return 1;
         }
     }
 
-    free(Tail);
-    fclose(file);
-    return 1;
+    p->Lex = saved;
+    p->Tok = key;
+    return 0;
 }
 
-static void PrintPrimitive(FILE* file, PrimitiveValue* pv) {
-    switch (pv->Type) {
-        case NUMBER_TYPE: fprintf(file, "%ld", pv->Number); break;
-        case DECIMAL_TYPE: fprintf(file, "%lf", pv->Decimal); break;
-        case STRING_TYPE: fprintf(file, "'%s'", pv->String); break;
-        default: printf("Unreachable!\n"); exit(1);
+// Declaration of 'Key' of type 'ty' in 'schema', or of any type if 'ty'
+// is -1
+static const SchemaKey *FindSchemaKey(const ConfigSchema *schema,
+                                      const char *Key, size_t len, int ty) {
+    if (!schema->Index)
+        return NULL;
+    uint64_t hash = HashKey(Key, len);
+    uint64_t slot = hash & schema->IndexMask;
+    while (schema->Index[slot]) {
+        const SchemaKey *sk = &schema->Keys[schema->Index[slot] - 1];
+        if (sk->Hash == hash && (ty < 0 || sk->Type == ty) &&
+            sk->Length == len && memcmp(sk->Key, Key, len) == 0)
+            return sk;
+        slot = (slot + 1) & schema->IndexMask;
     }
+    return NULL;
 }
 
-static void PrintVector(FILE* file, Vector* vec) {
-    fprintf(file, "[");
-    for (uint64_t i = 0; i < vec->Length; i++) {
-        PrimitiveValue* v = vec->Data[i]->Primitive;
-        PrintPrimitive(file, v);
-        if (i + 1 != vec->Length)
-            fprintf(file, ",");
+static int CheckPrimitive(const SchemaKey *sk, const PrimitiveValue *pv) {
+    if (sk->ValueType != NULL_TYPE && pv->Type != sk->ValueType)
+        return SCHEMA_TYPE_MISMATCH;
+    if (sk->Flags & SCHEMA_RANGE) {
+        double d = pv->Type == NUMBER_TYPE    ? (double)pv->Number
+                   : pv->Type == DECIMAL_TYPE ? pv->Decimal
+                                              : sk->Min;
+        if (d < sk->Min || d > sk->Max)
+            return SCHEMA_OUT_OF_RANGE;
     }
-    
-    fprintf(file, "]");
+    return 1;
 }
 
-void DumpConfig(FILE* file, Config* config) {
-    ConfigEntry* ce = config->List;
-    for (int i = 0; i < config->Entries; i++) {
-        fprintf(file, "%s = ", ce->Key);
-        Value* value = ce->Value;
-        if (ce->Type == PRIMITIVE_TYPE)
-            PrintPrimitive(file, value->Primitive);
-        else {
-            PrintVector(file, value->Array);
+static int CheckSchema(const ConfigSchema *schema, const SchemaKey *sk,
+                       const ConfigEntry *ce) {
+    // 'sk' is the first declaration of the key, not necessarily the one
+    // for the type the line turned out to have
+    if (sk->Type != ce->Type) {
+        sk = FindSchemaKey(schema, ce->Key, ce->KeyLength, ce->Type);
+        if (!sk)
+            return SCHEMA_TYPE_MISMATCH;
+    }
+
+    if (ce->Type == TABLE_TYPE)
+        return 1;
+    if (ce->Type == PRIMITIVE_TYPE)
+        return CheckPrimitive(sk, ce->Value->Primitive);
+
+    const Vector *vec = ce->Value->Array;
+    if (!(sk->Flags & SCHEMA_RANGE) && sk->ValueType != NULL_TYPE &&
+        vec->Length && vec->ElementType == sk->ValueType)
+        return 1;
+    for (uint64_t i = 0; i < vec->Length; i++) {
+        int status = CheckPrimitive(sk, &vec->Data[i]);
+        if (status < 0)
+            return status;
+    }
+    return 1;
+}
+
+static int SkipConfigLine(Parser *p);
+static int ParseInclude(Parser *p, ConfigEntry **entry);
+
+static int ParseCfg(Parser *p, ConfigEntry **entry) {
+    // *entry is only allocated, and set, if what we are
+    // parsing is an actual configuration. An <include> sets it to
+    // the whole list of entries the file brings in, if any
+
+    // <cfg> ::= <comment> | <config_line> | <include>
+    // Blank lines never make it here, the lexer skips them as whitespace
+    *entry = NULL;
+    if (p->Tok.Kind == TOKEN_COMMENT) {
+        advance(p);
+        return 1;
+    }
+
+    if (p->Tok.Kind != TOKEN_STRING)
+        return UNEXPECTED_TOKEN;
+    if (AtInclude(p))
+        return ParseInclude(p, entry);
+
+    const SchemaKey *sk = NULL;
+    if (p->Schema) {
+        sk = FindSchemaKey(p->Schema, p->Tok.Start, p->Tok.Length, -1);
+        if (!sk && !(p->Schema->Flags & SCHEMA_SKIP_UNKNOWN))
+            return SCHEMA_UNKNOWN_KEY;
+        if (!sk)
+            return SkipConfigLine(p);
+    }
+
+    if (p->Reparse) {
+        int status = ReuseConfigLine(p, entry);
+        if (status != 0)
+            return status;
+    }
+
+    ConfigEntry *ce = ArenaAlloc(p->Arena, sizeof(ConfigEntry));
+    if (!ce)
+        return OUT_OF_MEMORY;
+    ce->Next = NULL;
+    ce->Owner = p->Owner;
+
+    int status = ParseConfigLine(p, ce);
+    if (status > 0 && sk)
+        status = CheckSchema(p->Schema, sk, ce);
+    if (status < 0)
+        return status;
+
+    *entry = ce;
+    return 1;
+}
+
+static uint64_t IndexCapacity(uint64_t entries) {
+    // Open addressing with linear probing, kept at most half full
+    uint64_t capacity = 8;
+    while (capacity < entries * 2)
+        capacity *= 2;
+    return capacity;
+}
+
+static void FillIndex(Config *config) {
+    // Entries go in list order, so among duplicate keys the first one
+    // is still the one FindValue() finds, like the old linear scan did
+    memset(config->Index, 0, (config->IndexMask + 1) * sizeof(ConfigEntry *));
+    for (ConfigEntry *ce = config->List; ce; ce = ce->Next) {
+        uint64_t slot = ce->Hash & config->IndexMask;
+        while (config->Index[slot])
+            slot = (slot + 1) & config->IndexMask;
+        config->Index[slot] = ce;
+    }
+}
+
+static int BuildIndex(Config *config) {
+    uint64_t capacity = IndexCapacity(config->Entries);
+
+    config->Index = ArenaAlloc(config->Arena, capacity * sizeof(ConfigEntry *));
+    if (!config->Index)
+        return OUT_OF_MEMORY;
+    config->IndexMask = capacity - 1;
+    FillIndex(config);
+    return 1;
+}
+
+// First entry for 'Key' in 'config', whatever its type
+static ConfigEntry *FindKey(const Config *config, const char *Key, size_t len,
+                            uint64_t hash);
+
+static int BuildComposedIndex(Config *config) {
+    // For configs using <include>: a later definition of a key overrides
+    // every earlier one, whatever their types, and only the last one is
+    // kept in the index and in the list
+    uint64_t capacity = IndexCapacity(config->Entries);
+
+    config->Index = ArenaAlloc(config->Arena, capacity * sizeof(ConfigEntry *));
+    if (!config->Index)
+        return OUT_OF_MEMORY;
+    memset(config->Index, 0, capacity * sizeof(ConfigEntry *));
+    config->IndexMask = capacity - 1;
+
+    for (ConfigEntry *ce = config->List; ce; ce = ce->Next) {
+        uint64_t slot = ce->Hash & config->IndexMask;
+        ConfigEntry *other;
+        while ((other = config->Index[slot]) &&
+               !(other->Hash == ce->Hash && other->KeyLength == ce->KeyLength &&
+                 memcmp(other->Key, ce->Key, ce->KeyLength) == 0))
+            slot = (slot + 1) & config->IndexMask;
+        config->Index[slot] = ce;
+    }
+
+    ConfigEntry **link = &config->List;
+    while (*link) {
+        ConfigEntry *ce = *link;
+        if (FindKey(config, ce->Key, ce->KeyLength, ce->Hash) != ce) {
+            *link = ce->Next;
+            config->Entries--;
+        } else {
+            link = &ce->Next;
+        }
+    }
+    return 1;
+}
+
+static int ParseTable(Parser *p, Value *value) {
+    // <table> ::= "{" <cfg>* "}"
+    // The '{' has already been consumed. A table is a Config of its own
+    // that lives in the arena of the enclosing one. Schemas and reparses
+    // only know about the top level, so they sit out the lines inside
+    Config *table = ArenaAlloc(p->Arena, sizeof(Config));
+    if (!table)
+        return OUT_OF_MEMORY;
+    memset(table, 0, sizeof(Config));
+    table->Arena = p->Arena;
+    value->Table = table;
+
+    const ConfigSchema *schema = p->Schema;
+    Reparse *re = p->Reparse;
+    uint32_t includes = p->Includes;
+    p->Schema = NULL;
+    p->Reparse = NULL;
+    ConfigEntry **tail = &table->List;
+    int status = 1;
+    while (status > 0 && p->Tok.Kind != '}') {
+        if (p->Tok.Kind == TOKEN_EOF) {
+            status = UNEXPECTED_EOF;
+            break;
+        }
+        ConfigEntry *entry;
+        status = ParseCfg(p, &entry);
+        for (; status > 0 && entry; entry = entry->Next) {
+            *tail = entry;
+            tail = &entry->Next;
+            table->Entries++;
+        }
+    }
+    p->Schema = schema;
+    p->Reparse = re;
+    if (status < 0)
+        return status;
+    advance(p);
+
+    // Includes inside only make this table a composition
+    int composed = p->Includes != includes;
+    p->Includes = includes;
+    return composed ? BuildComposedIndex(table) : BuildIndex(table);
+}
+
+// An empty Config with an arena of its own, NULL when out of memory
+static Config *NewConfig(void) {
+    Config *config = malloc(sizeof(Config));
+    if (!config)
+        return NULL;
+
+    config->Entries = 0;
+    config->List = NULL;
+    config->Index = NULL;
+    config->IndexMask = 0;
+    config->Bound = NULL;
+    config->BoundCount = 0;
+    config->Stats = NULL;
+    config->HashSeed = 0;
+    config->Base = NULL;
+    config->Arena = ArenaCreate();
+    if (!config->Arena) {
+        free(config);
+        return NULL;
+    }
+#ifdef CFG_STATS
+    config->Stats = &config->Arena->Stats;
+#endif
+    return config;
+}
+
+static ConfigEntry *FindKey(const Config *config, const char *Key, size_t len,
+                            uint64_t hash) {
+    uint64_t slot = hash & config->IndexMask;
+    while (1) {
+        ConfigEntry *ce = config->Index[slot];
+        if (!ce)
+            return NULL;
+        if (ce->Hash == hash && ce->KeyLength == len &&
+            memcmp(ce->Key, Key, len) == 0)
+            return ce;
+        slot = (slot + 1) & config->IndexMask;
+    }
+}
+
+static int CheckRequired(const Config *config, const ConfigSchema *schema) {
+    for (uint32_t i = 0; i < schema->Count; i++) {
+        const SchemaKey *sk = &schema->Keys[i];
+        if ((sk->Flags & SCHEMA_REQUIRED) &&
+            !FindKey(config, sk->Key, sk->Length, sk->Hash))
+            return SCHEMA_MISSING_KEY;
+    }
+    return 1;
+}
+
+static int SamePrimitive(const PrimitiveValue *a, const PrimitiveValue *b) {
+    if (a->Type != b->Type)
+        return 0;
+    switch (a->Type) {
+        case NUMBER_TYPE: return a->Number == b->Number;
+        case DECIMAL_TYPE: return memcmp(&a->Decimal, &b->Decimal, sizeof(double)) == 0;
+        case STRING_TYPE:
+            return a->Length == b->Length &&
+                   memcmp(a->String, b->String, a->Length) == 0;
+        default: return 0;
+    }
+}
+
+static int SameEntry(const ConfigEntry *a, const ConfigEntry *b) {
+    if (a->Value == b->Value)
+        return 1;
+    if (a->Type != b->Type)
+        return 0;
+    if (a->Type == PRIMITIVE_TYPE)
+        return SamePrimitive(a->Value->Primitive, b->Value->Primitive);
+    if (a->Type == TABLE_TYPE) {
+        // Same lines in the same order
+        const ConfigEntry *x = a->Value->Table->List;
+        const ConfigEntry *y = b->Value->Table->List;
+        for (; x && y; x = x->Next, y = y->Next) {
+            if (x->KeyLength != y->KeyLength ||
+                memcmp(x->Key, y->Key, x->KeyLength) != 0 || !SameEntry(x, y))
+                return 0;
+        }
+        return !x && !y;
+    }
+
+    Vector *x = a->Value->Array, *y = b->Value->Array;
+    if (x->Length != y->Length)
+        return 0;
+    for (uint64_t i = 0; i < x->Length; i++) {
+        if (!SamePrimitive(&x->Data[i], &y->Data[i]))
+            return 0;
+    }
+    return 1;
+}
+
+static void ReportChanges(Config *config, Reparse *re) {
+    // A key counts as changed when the definition FindValue() finds, the
+    // first one or with includes the last, differs from before. The same
+    // line of text is the same value, so only the others are compared.
+    // Reused lines count too: dropping a duplicate can change the value
+    // without touching the line that now defines it. Tables are always
+    // compared, as what they include may have changed since
+    Config *old = re->Old;
+    for (ConfigEntry *ce = config->List; ce; ce = ce->Next) {
+        if (FindKey(config, ce->Key, ce->KeyLength, ce->Hash) != ce)
+            continue;
+        uint64_t hash = old->HashSeed
+                            ? HashKeySeeded(ce->Key, ce->KeyLength, old->HashSeed)
+                            : ce->Hash;
+        ConfigEntry *prev = FindKey(old, ce->Key, ce->KeyLength, hash);
+        if (!prev)
+            re->OnChange(re->Userdata, ce->Key, ce->KeyLength, KEY_ADDED);
+        else if ((ce->Type == TABLE_TYPE || !ce->SourceHash ||
+                  prev->SourceHash != ce->SourceHash) &&
+                 !SameEntry(prev, ce))
+            re->OnChange(re->Userdata, ce->Key, ce->KeyLength, KEY_CHANGED);
+    }
+
+    for (ConfigEntry *ce = old->List; ce; ce = ce->Next) {
+        if (FindKey(old, ce->Key, ce->KeyLength, ce->Hash) == ce &&
+            !FindKey(config, ce->Key, ce->KeyLength,
+                     HashKey(ce->Key, ce->KeyLength)))
+            re->OnChange(re->Userdata, ce->Key, ce->KeyLength, KEY_REMOVED);
+    }
+}
+
+// Parse the <cfg>s starting before 'stop', appending entries at '*tail'
+static int ParseEntries(Parser *p, const char *stop, ConfigEntry ***tail,
+                        uint64_t *count) {
+    // <prog> ::= <cfg>* <EOF>
+    while (p->Tok.Kind != TOKEN_EOF && p->Tok.Start < stop) {
+        ConfigEntry *entry;
+        int status = ParseCfg(p, &entry);
+        if (status < 0)
+            return status;
+
+        for (; entry; entry = entry->Next) {
+            **tail = entry;
+            *tail = &entry->Next;
+            (*count)++;
+        }
+    }
+    return 1;
+}
+
+#ifdef CFG_STATS
+static void FinishStats(Config *config, size_t len, uint64_t start) {
+    ConfigStats *stats = config->Stats;
+    STAT_ADD(BytesRead, len);
+    STAT_ADD(Entries, config->Entries);
+    STAT_ADD(ParseNanos, StatNow() - start);
+}
+#endif
+
+static int ParseInput(const char *data, size_t len, const ParseOptions *opts,
+                      Config **result) {
+#ifdef CFG_STATS
+    uint64_t start = StatNow();
+#endif
+    *result = NULL;
+    Config *config = NewConfig();
+    if (!config)
+        return OUT_OF_MEMORY;
+
+    // Nodes take some six times the bytes of the text they come from.
+    // Sizing the first block after that keeps small configs small
+    size_t first = ARENA_MIN_BLOCK / 16 + len * 8;
+    if (len < ARENA_MIN_BLOCK && first < ARENA_MIN_BLOCK)
+        config->Arena->FirstBlock = first;
+
+    Reparse *re = opts->Reparse;
+    Parser parser = {{data, data + len, data}, {0}, config->Arena, opts->Flags,
+                     re, config->Arena, opts->Schema, opts, 0};
+    Parser *p = &parser;
+    advance(p);
+
+    ConfigEntry **Tail = &config->List; // maintain tail for fast access
+    int status = ParseEntries(p, data + len, &Tail, &config->Entries);
+    const char *at = status < 0 ? p->Tok.Start : NULL;
+    // Overrides compose like includes do: the last definition of a key wins
+    config->Base = opts->Base;
+    if (status > 0)
+        status = p->Includes || config->Base ? BuildComposedIndex(config)
+                                             : BuildIndex(config);
+    if (status > 0 && opts->Schema && !opts->Depth)
+        status = CheckRequired(config, opts->Schema);
+    if (status < 0) {
+        NoteError(p, at, status);
+        FreeConfig(config);
+        return status;
+    }
+
+    if (re && re->OnChange)
+        ReportChanges(config, re);
+
+#ifdef CFG_STATS
+    FinishStats(config, len, start);
+#endif
+    *result = config;
+    return 1;
+}
+
+/* Parallel parsing splits the input just past a newline into one chunk
+ * per thread, each parsed into an arena of its own. A split can land
+ * inside a quoted string or an array spanning lines, so a chunk is only
+ * used if the chunk before it stopped right where it starts. Otherwise
+ * the chunk before simply carries on through it, which is exactly what a
+ * sequential parse would have done.
+ */
+#define PARALLEL_MIN_CHUNK (256 * 1024)
+
+typedef struct Chunk {
+    Parser Parser;
+    const char *Start; // first token of the chunk
+    const char *Stop; // Start of the next chunk
+    ConfigEntry *List;
+    ConfigEntry **Tail;
+    uint64_t Entries;
+    int Status;
+    int Joinable; // 'Thread' is running it
+    pthread_t Thread;
+} Chunk;
+
+static void *ParseChunk(void *arg) {
+    Chunk *c = arg;
+    c->Status = ParseEntries(&c->Parser, c->Stop, &c->Tail, &c->Entries);
+    return NULL;
+}
+
+static int StitchChunks(Config *config, Chunk *chunks, size_t n) {
+    // Chunks are linked in order. Arenas of chunks that were used are
+    // kept by the Config, the others are released
+    ConfigEntry **tail = &config->List;
+    Chunk *cur = &chunks[0];
+    int status = 1;
+    for (size_t i = 1; i < n; i++) {
+        Chunk *next = &chunks[i];
+        if (status > 0 && cur->Status > 0 &&
+            cur->Parser.Tok.Start == next->Start) {
+            *tail = cur->List;
+            if (cur->List)
+                tail = cur->Tail;
+            config->Entries += cur->Entries;
+#ifdef CFG_STATS
+            if (cur != chunks)
+                MergeStats(config->Stats, &cur->Parser.Arena->Stats);
+#endif
+            cur = next;
+            if (ArenaKeep(config->Arena, next->Parser.Arena) < 0)
+                status = OUT_OF_MEMORY;
+        } else if (status > 0 && cur->Status > 0) {
+            cur->Status = ParseEntries(&cur->Parser, next->Stop, &cur->Tail,
+                                       &cur->Entries);
+        }
+        ArenaRelease(next->Parser.Arena);
+    }
+
+    if (status < 0)
+        return status;
+    if (cur->Status < 0)
+        return cur->Status;
+    *tail = cur->List;
+    config->Entries += cur->Entries;
+#ifdef CFG_STATS
+    if (cur != chunks)
+        MergeStats(config->Stats, &cur->Parser.Arena->Stats);
+#endif
+    return 1;
+}
+
+static int ParseInputParallel(const char *data, size_t len,
+                              const ParseOptions *opts, Config **result) {
+    int nthreads = opts->Threads;
+    if (nthreads <= 0)
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    size_t n = len / PARALLEL_MIN_CHUNK;
+    if ((size_t)nthreads < n)
+        n = (size_t)nthreads;
+    if (n <= 1)
+        return ParseInput(data, len, opts, result);
+
+#ifdef CFG_STATS
+    uint64_t start = StatNow();
+#endif
+    *result = NULL;
+    Config *config = NewConfig();
+    Chunk *chunks = calloc(n, sizeof(Chunk));
+    if (!config || !chunks) {
+        if (config)
+            FreeConfig(config);
+        free(chunks);
+        return OUT_OF_MEMORY;
+    }
+
+    int status = 1;
+    const char *end = data + len;
+    for (size_t i = 0; i < n; i++) {
+        const char *start = data;
+        Arena *arena = config->Arena;
+        if (i) {
+            start = data + len / n * i;
+            const char *nl = memchr(start, '\n', end - start);
+            start = nl ? nl + 1 : end;
+            arena = ArenaCreate();
+            if (!arena)
+                status = OUT_OF_MEMORY;
+        }
+
+        Chunk *c = &chunks[i];
+        c->Parser = (Parser){{start, end, data}, {0}, arena, opts->Flags, NULL,
+                             config->Arena, opts->Schema, opts, 0};
+        advance(&c->Parser);
+        c->Start = c->Parser.Tok.Start;
+        c->List = NULL;
+        c->Tail = &c->List;
+        c->Status = 1;
+    }
+    for (size_t i = 0; i < n; i++)
+        chunks[i].Stop = i + 1 < n ? chunks[i + 1].Start : end;
+
+    // Chunk 0 is ours, and so is any chunk no thread could be started for
+    for (size_t i = 1; i < n && status > 0; i++) {
+        chunks[i].Joinable =
+            pthread_create(&chunks[i].Thread, NULL, ParseChunk, &chunks[i]) == 0;
+    }
+    for (size_t i = 0; i < n && status > 0; i++) {
+        if (!chunks[i].Joinable)
+            ParseChunk(&chunks[i]);
+    }
+    for (size_t i = 1; i < n; i++) {
+        if (chunks[i].Joinable)
+            pthread_join(chunks[i].Thread, NULL);
+    }
+
+    uint32_t includes = 0;
+    for (size_t i = 0; i < n; i++)
+        includes += chunks[i].Parser.Includes;
+    if (status > 0) {
+        status = StitchChunks(config, chunks, n);
+    } else {
+        for (size_t i = 1; i < n; i++)
+            ArenaRelease(chunks[i].Parser.Arena);
+    }
+    free(chunks);
+
+    if (status > 0)
+        status = includes ? BuildComposedIndex(config) : BuildIndex(config);
+    if (status > 0 && opts->Schema && !opts->Depth)
+        status = CheckRequired(config, opts->Schema);
+    if (status < 0) {
+        FreeConfig(config);
+        return status;
+    }
+
+#ifdef CFG_STATS
+    FinishStats(config, len, start);
+#endif
+    *result = config;
+    return 1;
+}
+
+int ParseConfigBufferEx(const char *data, size_t len, int flags,
+                        Config **result) {
+    ParseOptions opts = {flags, NULL, 1, NULL, NULL, NULL, 0, NULL, NULL, NULL};
+    return ParseInput(data, len, &opts, result);
+}
+
+int ParseConfigBufferParallel(const char *data, size_t len, int nthreads,
+                              int flags, Config **result) {
+    ParseOptions opts = {flags, NULL, nthreads, NULL, NULL,
+                         NULL, 0, NULL, NULL, NULL};
+    return ParseInputParallel(data, len, &opts, result);
+}
+
+int ParseConfigBufferSchema(const char *data, size_t len,
+                            const ConfigSchema *schema, int flags,
+                            Config **result) {
+    ParseOptions opts = {flags, NULL, 1, schema, NULL,
+                         NULL, 0, NULL, NULL, NULL};
+    return ParseInput(data, len, &opts, result);
+}
+
+int ParseConfigBuffer(const char *data, size_t len, Config **result) {
+    return ParseConfigBufferEx(data, len, 0, result);
+}
+
+static int ReadInto(int fd, char **buf, size_t *capacity, size_t *length) {
+    // Slurp everything 'fd' has to offer into '*buf', which has room for
+    // '*capacity' bytes and grows as needed. Regular files tell us their
+    // size up front, pipes and sockets don't
+    struct stat st;
+    size_t want = 4096, len = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+        want = (size_t)st.st_size + 1;
+
+    if (*capacity < want) {
+        free(*buf);
+        *capacity = 0;
+        if (!(*buf = malloc(want)))
+            return OUT_OF_MEMORY;
+        *capacity = want;
+    }
+
+    char *data = *buf;
+    size_t cap = *capacity;
+    while (1) {
+        if (len == cap) {
+            char *grown = realloc(data, cap * 2);
+            if (!grown)
+                return OUT_OF_MEMORY;
+            *buf = data = grown;
+            *capacity = cap *= 2;
+        }
+
+        ssize_t n = read(fd, data + len, cap - len);
+        if (n == 0)
+            break;
+        if (n < 0 && errno == EINTR)
+            continue; // interrupted by a signal before any data came
+        if (n < 0)
+            return FILE_NO_ACCESS;
+        len += (size_t)n;
+    }
+
+    *length = len;
+    return 1;
+}
+
+static int ReadInput(int fd, char **result, size_t *length) {
+    char *data = NULL;
+    size_t capacity = 0;
+    int status = ReadInto(fd, &data, &capacity, length);
+    if (status < 0) {
+        free(data);
+        return status;
+    }
+    *result = data;
+    return 1;
+}
+
+static int MapInput(int fd, char **result, size_t *length, int *mapped) {
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+        return FILE_NO_ACCESS;
+
+    // Only regular files can be mapped, and mmap() refuses empty ones
+    *mapped = 0;
+    if (!S_ISREG(st.st_mode))
+        return ReadInput(fd, result, length);
+    if (st.st_size == 0) {
+        *result = NULL;
+        *length = 0;
+        return 1;
+    }
+
+    size_t len = (size_t)st.st_size;
+    void *data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+        return ReadInput(fd, result, length);
+
+    // The lexer only ever walks forward
+    madvise(data, len, MADV_SEQUENTIAL);
+    *result = data;
+    *length = len;
+    *mapped = 1;
+    return 1;
+}
+
+// Read or map all of 'fd' as 'opts' say and parse it, split across
+// threads by ParseInputParallel() unless opts->Threads is 1
+static int ParseFd(int fd, const ParseOptions *opts, Config **result) {
+    // A context lends its buffer to the top level of a parse, unless the
+    // Config is going to keep the input
+    ParserContext *ctx = opts->Context;
+    int borrow = ctx && !opts->Depth &&
+                 !(opts->Flags & (PARSE_MMAP | PARSE_ZERO_COPY));
+    char *data;
+    size_t len;
+    int mapped = 0;
+    int status;
+    if (borrow) {
+        status = ReadInto(fd, &ctx->Buffer, &ctx->Capacity, &len);
+        data = ctx->Buffer;
+    } else if (opts->Flags & PARSE_MMAP) {
+        status = MapInput(fd, &data, &len, &mapped);
+    } else {
+        status = ReadInput(fd, &data, &len);
+    }
+    if (status < 0)
+        return status;
+
+    status = opts->Threads != 1 ? ParseInputParallel(data, len, opts, result)
+                                : ParseInput(data, len, opts, result);
+    if (status > 0 && (opts->Flags & PARSE_ZERO_COPY)) {
+        // Strings point into the input, keep it for as long as the Config
+        Arena *arena = (*result)->Arena;
+        arena->Backing = data;
+        arena->BackingLength = len;
+        arena->BackingMapped = mapped;
+    } else if (mapped) {
+        munmap(data, len);
+    } else if (!borrow) {
+        free(data);
+    }
+    return status;
+}
+
+int ParseConfigFd(int fd, Config **result) {
+    ParseOptions opts = {0, NULL, 1, NULL, NULL, NULL, 0, NULL, NULL, NULL};
+    return ParseFd(fd, &opts, result);
+}
+
+static int ParseFile(const char *name, const ParseOptions *opts,
+                     Config **result) {
+    int fd = open(name, O_RDONLY);
+    if (fd < 0)
+        return FILE_NO_ACCESS;
+
+    // Included files are found relative to this one
+    ParseOptions local = *opts;
+    local.Path = name;
+    int status = ParseFd(fd, &local, result);
+    close(fd);
+    return status;
+}
+
+/* An <include> splices the entries of another file in at its place. That
+ * file is parsed into a Config of its own, whose entries are linked to
+ * rather than copied, keeping its arena alive (see ConfigEntry::Owner).
+ * With an IncludeCache, the Config of an included file is kept and used
+ * again for as long as the file, and every file it includes in turn, is
+ * unchanged on disk
+ */
+#define INCLUDE_MAX_DEPTH (16)
+
+typedef struct FileStamp {
+    char *Path;
+    struct stat St;
+} FileStamp;
+
+// Files a parse read, directly or through includes
+typedef struct FileStamps {
+    FileStamp *Files;
+    size_t Count;
+    size_t Capacity;
+} FileStamps;
+
+typedef struct CachedInclude {
+    char *Path;
+    int Flags; // the Config was parsed with
+    const ConfigSchema *Schema; // ditto
+    Config *Config;
+    FileStamps Stamps; // Files[0] is 'Path' itself
+    struct CachedInclude *Next;
+} CachedInclude;
+
+struct IncludeCache {
+    pthread_mutex_t Lock;
+    CachedInclude *Head;
+};
+
+static int SameFile(const struct stat *a, const struct stat *b) {
+    return a->st_ino == b->st_ino && a->st_dev == b->st_dev &&
+           a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+           a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+static int AddStamp(FileStamps *stamps, const char *path,
+                    const struct stat *st) {
+    if (stamps->Count == stamps->Capacity) {
+        size_t capacity = stamps->Capacity ? stamps->Capacity * 2 : 4;
+        FileStamp *files = realloc(stamps->Files, capacity * sizeof(FileStamp));
+        if (!files)
+            return OUT_OF_MEMORY;
+        stamps->Files = files;
+        stamps->Capacity = capacity;
+    }
+
+    char *copy = strdup(path);
+    if (!copy)
+        return OUT_OF_MEMORY;
+    stamps->Files[stamps->Count].Path = copy;
+    stamps->Files[stamps->Count].St = *st;
+    stamps->Count++;
+    return 1;
+}
+
+static int AddStamps(FileStamps *stamps, const FileStamps *from) {
+    for (size_t i = 0; i < from->Count; i++) {
+        if (AddStamp(stamps, from->Files[i].Path, &from->Files[i].St) < 0)
+            return OUT_OF_MEMORY;
+    }
+    return 1;
+}
+
+static void FreeStamps(FileStamps *stamps) {
+    for (size_t i = 0; i < stamps->Count; i++)
+        free(stamps->Files[i].Path);
+    free(stamps->Files);
+}
+
+static int Unchanged(const FileStamps *stamps) {
+    for (size_t i = 0; i < stamps->Count; i++) {
+        struct stat st;
+        if (stat(stamps->Files[i].Path, &st) < 0 ||
+            !SameFile(&st, &stamps->Files[i].St))
+            return 0;
+    }
+    return 1;
+}
+
+// 'len' bytes at 'path', relative to the directory of 'from' unless
+// absolute or 'from' is NULL. NULL when out of memory
+static char *ResolveInclude(const char *from, const char *path, size_t len) {
+    size_t dir = 0;
+    if (from && (len == 0 || path[0] != '/')) {
+        const char *slash = strrchr(from, '/');
+        if (slash)
+            dir = (size_t)(slash - from) + 1;
+    }
+
+    char *resolved = malloc(dir + len + 1);
+    if (!resolved)
+        return NULL;
+    if (dir)
+        memcpy(resolved, from, dir);
+    memcpy(resolved + dir, path, len);
+    resolved[dir + len] = '\0';
+    return resolved;
+}
+
+// Parse 'path' as included with 'opts', recording it and everything it
+// includes in 'stamps'
+static int ParseIncluded(const ParseOptions *opts, const char *path,
+                         FileStamps *stamps, Config **result) {
+    if (opts->Depth >= INCLUDE_MAX_DEPTH)
+        return INVALID_INCLUDE;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return FILE_NO_ACCESS;
+
+    // The stamp comes from the descriptor, so it matches what is parsed
+    struct stat st;
+    int status = fstat(fd, &st) < 0 ? FILE_NO_ACCESS
+                                    : AddStamp(stamps, path, &st);
+    if (status > 0) {
+        ParseOptions sub = {opts->Flags, NULL, 1, opts->Schema, opts->Cache,
+                            path, opts->Depth + 1, stamps, opts->Context, NULL};
+        status = ParseFd(fd, &sub, result);
+    }
+    close(fd);
+    return status;
+}
+
+// Entries of the file at 'path' in '*list', alive for as long as '*arena',
+// which the caller has to release
+static int LoadInclude(const ParseOptions *opts, const char *path,
+                       ConfigEntry **list, Arena **arena) {
+    IncludeCache *cache = opts->Cache;
+    FileStamps stamps = {NULL, 0, 0};
+    Config *config;
+    int status;
+    if (!cache) {
+        status = ParseIncluded(opts, path, &stamps, &config);
+        FreeStamps(&stamps);
+        if (status < 0)
+            return status;
+        *list = config->List;
+        *arena = config->Arena;
+        ArenaRetain(*arena);
+        FreeConfig(config);
+        return 1;
+    }
+
+    pthread_mutex_lock(&cache->Lock);
+    CachedInclude *ci = cache->Head;
+    while (ci && (ci->Flags != opts->Flags || ci->Schema != opts->Schema ||
+                  strcmp(ci->Path, path) != 0))
+        ci = ci->Next;
+    if (ci && Unchanged(&ci->Stamps)) {
+        status = opts->Stamps ? AddStamps(opts->Stamps, &ci->Stamps) : 1;
+        if (status > 0) {
+            *list = ci->Config->List;
+            *arena = ci->Config->Arena;
+            ArenaRetain(*arena);
+        }
+        pthread_mutex_unlock(&cache->Lock);
+        return status;
+    }
+    pthread_mutex_unlock(&cache->Lock);
+
+    // Parse without holding the lock, nested includes need it too
+    status = ParseIncluded(opts, path, &stamps, &config);
+    if (status < 0) {
+        FreeStamps(&stamps);
+        return status;
+    }
+    if (opts->Stamps)
+        status = AddStamps(opts->Stamps, &stamps);
+    ci = status > 0 ? malloc(sizeof(CachedInclude)) : NULL;
+    if (ci && !(ci->Path = strdup(path))) {
+        free(ci);
+        ci = NULL;
+    }
+    if (!ci) {
+        FreeConfig(config);
+        FreeStamps(&stamps);
+        return OUT_OF_MEMORY;
+    }
+    ci->Flags = opts->Flags;
+    ci->Schema = opts->Schema;
+    ci->Config = config;
+    ci->Stamps = stamps;
+    *list = config->List;
+    *arena = config->Arena;
+    ArenaRetain(*arena);
+
+    // Replace what is there for the same file, which may have been added
+    // by someone else in the meantime. Configs built from the old one
+    // keep its arena alive
+    pthread_mutex_lock(&cache->Lock);
+    CachedInclude **link = &cache->Head;
+    while (*link && ((*link)->Flags != ci->Flags ||
+                     (*link)->Schema != ci->Schema ||
+                     strcmp((*link)->Path, path) != 0))
+        link = &(*link)->Next;
+    CachedInclude *old = *link;
+    ci->Next = old ? old->Next : NULL;
+    *link = ci;
+    pthread_mutex_unlock(&cache->Lock);
+
+    if (old) {
+        FreeConfig(old->Config);
+        FreeStamps(&old->Stamps);
+        free(old->Path);
+        free(old);
+    }
+    return 1;
+}
+
+static int ParseInclude(Parser *p, ConfigEntry **entry) {
+    // <include> ::= "include" <quoted_string> ";"
+    // Failures to load the file are reported at the directive
+    Lexer saved = p->Lex;
+    Token tok = p->Tok;
+    advance(p);
+    char *path = ResolveInclude(p->Options->Path, p->Tok.Start, p->Tok.Length);
+    if (!path)
+        return OUT_OF_MEMORY;
+    advance(p);
+    if (expect(p, ';') < 0) {
+        free(path);
+        return p->Tok.Kind == TOKEN_EOF ? UNEXPECTED_EOF : UNEXPECTED_TOKEN;
+    }
+
+    ConfigEntry *list;
+    Arena *arena = NULL;
+    int status = LoadInclude(p->Options, path, &list, &arena);
+    free(path);
+    if (status < 0) {
+        p->Lex = saved;
+        p->Tok = tok;
+        return status;
+    }
+
+    // Copies of the entries, so the list can be linked and pruned
+    ConfigEntry **tail = entry;
+    for (ConfigEntry *ce = list; ce && status > 0; ce = ce->Next) {
+        ConfigEntry *copy = ArenaAlloc(p->Arena, sizeof(ConfigEntry));
+        if (!copy || ArenaKeep(p->Arena, ce->Owner) < 0) {
+            status = OUT_OF_MEMORY;
+            break;
+        }
+        *copy = *ce;
+        copy->Next = NULL;
+        *tail = copy;
+        tail = &copy->Next;
+    }
+    ArenaRelease(arena);
+    p->Includes++;
+    return status;
+}
+
+IncludeCache *CreateIncludeCache(void) {
+    IncludeCache *cache = malloc(sizeof(IncludeCache));
+    if (!cache)
+        return NULL;
+    pthread_mutex_init(&cache->Lock, NULL);
+    cache->Head = NULL;
+    return cache;
+}
+
+void FreeIncludeCache(IncludeCache *cache) {
+    for (CachedInclude *ci = cache->Head, *next; ci; ci = next) {
+        next = ci->Next;
+        FreeConfig(ci->Config);
+        FreeStamps(&ci->Stamps);
+        free(ci->Path);
+        free(ci);
+    }
+    pthread_mutex_destroy(&cache->Lock);
+    free(cache);
+}
+
+int ParseConfigComposed(const char *name, IncludeCache *cache, int flags,
+                        Config **result) {
+    ParseOptions opts = {flags, NULL, 1, NULL, cache,
+                         NULL, 0, NULL, NULL, NULL};
+    return ParseFile(name, &opts, result);
+}
+
+ParserContext *CreateParserContext(void) {
+    return calloc(1, sizeof(ParserContext));
+}
+
+static void ResetContext(ParserContext *ctx) {
+    free(ctx->File);
+    ctx->Status = 0;
+    ctx->File = NULL;
+    ctx->Offset = 0;
+    ctx->Line = 0;
+    ctx->Column = 0;
+}
+
+static int FinishContext(ParserContext *ctx, const char *name, int status) {
+    // Failures before parsing even started, like a missing file, were not
+    // recorded by the parser
+    if (!ctx->Status) {
+        ctx->Status = status;
+        if (status < 0 && name)
+            ctx->File = strdup(name);
+    }
+    return status;
+}
+
+int ParseConfigContext(ParserContext *ctx, const char *name, int flags,
+                       Config **result) {
+    ParseOptions opts = {flags, NULL, 1, NULL, NULL, NULL, 0, NULL, ctx, NULL};
+    ResetContext(ctx);
+    *result = NULL;
+    return FinishContext(ctx, name, ParseFile(name, &opts, result));
+}
+
+int ParseConfigBufferContext(ParserContext *ctx, const char *data, size_t len,
+                             int flags, Config **result) {
+    ParseOptions opts = {flags, NULL, 1, NULL, NULL, NULL, 0, NULL, ctx, NULL};
+    ResetContext(ctx);
+    return FinishContext(ctx, NULL, ParseInput(data, len, &opts, result));
+}
+
+void GetParseError(const ParserContext *ctx, ParseError *err) {
+    err->Status = ctx->Status;
+    err->File = ctx->File;
+    err->Offset = ctx->Offset;
+    err->Line = ctx->Line;
+    err->Column = ctx->Column;
+}
+
+void FreeParserContext(ParserContext *ctx) {
+    free(ctx->File);
+    free(ctx->Buffer);
+    free(ctx);
+}
+
+/* ParseConfigs() deals the paths out to its workers in contiguous ranges.
+ * A worker takes files from the front of its own range and, once that is
+ * empty, steals the back half of someone else's, so a few slow files do
+ * not hold up the ones queued behind them. While a worker parses a file,
+ * the kernel is already reading in the next one of its range
+ */
+typedef struct BulkJob BulkJob;
+
+typedef struct BulkWorker {
+    // (next << 32) | end of the paths left to this worker. Owner and
+    // thieves both move it with a compare and swap
+    alignas(64) uint64_t Range;
+    BulkJob *Job;
+    ParserContext *Context; // NULL when out of memory, which is fine
+    uint32_t Self;
+    int Joinable; // 'Thread' is running it
+    pthread_t Thread;
+} BulkWorker;
+
+struct BulkJob {
+    const char **Paths;
+    Config **Out;
+    int *Status;
+    int Flags;
+    BulkWorker *Workers;
+    uint32_t Count; // of workers
+    size_t Parsed; // files that parsed
+};
+
+static int TakeJob(BulkWorker *w, uint32_t *job) {
+    uint64_t range = __atomic_load_n(&w->Range, __ATOMIC_ACQUIRE);
+    while ((uint32_t)(range >> 32) < (uint32_t)range) {
+        if (__atomic_compare_exchange_n(&w->Range, &range,
+                                        range + ((uint64_t)1 << 32), 1,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            *job = (uint32_t)(range >> 32);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static int StealJobs(BulkWorker *thief) {
+    // Only called with the thief's own range empty, which nobody else
+    // touches then, so it can simply be stored
+    BulkJob *job = thief->Job;
+    for (uint32_t i = 1; i < job->Count; i++) {
+        BulkWorker *victim = &job->Workers[(thief->Self + i) % job->Count];
+        uint64_t range = __atomic_load_n(&victim->Range, __ATOMIC_ACQUIRE);
+        while ((uint32_t)(range >> 32) < (uint32_t)range) {
+            uint32_t next = (uint32_t)(range >> 32), end = (uint32_t)range;
+            uint32_t mid = next + (end - next) / 2;
+            if (__atomic_compare_exchange_n(&victim->Range, &range,
+                                            ((uint64_t)next << 32) | mid, 1,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)) {
+                __atomic_store_n(&thief->Range, ((uint64_t)mid << 32) | end,
+                                 __ATOMIC_RELEASE);
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+static void *BulkWork(void *arg) {
+    BulkWorker *w = arg;
+    BulkJob *job = w->Job;
+    int ahead = -1; // descriptor of the file read ahead, if any
+    uint32_t aheadJob = 0, i;
+    while (TakeJob(w, &i) || (StealJobs(w) && TakeJob(w, &i))) {
+        int fd = -1;
+        if (ahead >= 0 && aheadJob == i)
+            fd = ahead;
+        else if (ahead >= 0)
+            close(ahead); // stolen in the meantime
+        ahead = -1;
+
+        uint64_t range = __atomic_load_n(&w->Range, __ATOMIC_ACQUIRE);
+        if ((uint32_t)(range >> 32) < (uint32_t)range) {
+            aheadJob = (uint32_t)(range >> 32);
+            ahead = open(job->Paths[aheadJob], O_RDONLY);
+            if (ahead >= 0)
+                posix_fadvise(ahead, 0, 0, POSIX_FADV_WILLNEED);
+        }
+
+        int status = FILE_NO_ACCESS;
+        job->Out[i] = NULL;
+        if (fd < 0)
+            fd = open(job->Paths[i], O_RDONLY);
+        if (fd >= 0) {
+            ParseOptions opts = {job->Flags, NULL, 1, NULL, NULL,
+                                 job->Paths[i], 0, NULL, w->Context, NULL};
+            if (w->Context)
+                ResetContext(w->Context);
+            status = ParseFd(fd, &opts, &job->Out[i]);
+            close(fd);
+        }
+        job->Status[i] = status;
+        if (status > 0)
+            __atomic_add_fetch(&job->Parsed, 1, __ATOMIC_RELAXED);
+    }
+    if (ahead >= 0)
+        close(ahead);
+    return NULL;
+}
+
+long ParseConfigs(const char **paths, size_t n, Config **out, int *status,
+                  int nthreads, int flags) {
+    if (n > UINT32_MAX)
+        return OUT_OF_MEMORY;
+    if (nthreads <= 0)
+        nthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads <= 0)
+        nthreads = 1;
+    uint32_t count = (size_t)nthreads < n ? (uint32_t)nthreads : (uint32_t)n;
+    if (!count)
+        return 0;
+
+    BulkWorker *workers = aligned_alloc(alignof(BulkWorker),
+                                        count * sizeof(BulkWorker));
+    if (!workers)
+        return OUT_OF_MEMORY;
+    BulkJob job = {paths, out, status, flags, workers, count, 0};
+    for (uint32_t i = 0; i < count; i++) {
+        BulkWorker *w = &workers[i];
+        uint64_t lo = n * i / count, hi = n * (i + 1) / count;
+        w->Range = (lo << 32) | hi;
+        w->Job = &job;
+        w->Context = CreateParserContext();
+        w->Self = i;
+        w->Joinable = 0;
+    }
+
+    // Worker 0 is us. Ranges of workers that could not be started are
+    // stolen by the others
+    for (uint32_t i = 1; i < count; i++) {
+        workers[i].Joinable =
+            pthread_create(&workers[i].Thread, NULL, BulkWork, &workers[i]) == 0;
+    }
+    BulkWork(&workers[0]);
+    for (uint32_t i = 0; i < count; i++) {
+        if (workers[i].Joinable)
+            pthread_join(workers[i].Thread, NULL);
+        if (workers[i].Context)
+            FreeParserContext(workers[i].Context);
+    }
+    free(workers);
+    return (long)job.Parsed;
+}
+
+int ParseConfigEx(const char *name, int flags, Config **result) {
+    ParseOptions opts = {flags, NULL, 1, NULL, NULL, NULL, 0, NULL, NULL, NULL};
+    return ParseFile(name, &opts, result);
+}
+
+int ParseConfigParallel(const char *name, int nthreads, int flags,
+                        Config **result) {
+    ParseOptions opts = {flags, NULL, nthreads, NULL, NULL,
+                         NULL, 0, NULL, NULL, NULL};
+    return ParseFile(name, &opts, result);
+}
+
+int ParseConfigSchema(const char *name, const ConfigSchema *schema, int flags,
+                      Config **result) {
+    ParseOptions opts = {flags, NULL, 1, schema, NULL,
+                         NULL, 0, NULL, NULL, NULL};
+    return ParseFile(name, &opts, result);
+}
+
+int ReparseConfig(Config *old, const char *name, int flags, Config **result,
+                  ConfigChangeFn fn, void *userdata) {
+    if (old->Base)
+        return OVERLAY_NOT_SUPPORTED;
+    Reparse re = {old, fn, userdata};
+    ParseOptions opts = {flags, &re, 1, NULL, NULL, NULL, 0, NULL, NULL, NULL};
+    return ParseFile(name, &opts, result);
+}
+
+int ReparseConfigBuffer(Config *old, const char *data, size_t len, int flags,
+                        Config **result, ConfigChangeFn fn, void *userdata) {
+    if (old->Base)
+        return OVERLAY_NOT_SUPPORTED;
+    Reparse re = {old, fn, userdata};
+    ParseOptions opts = {flags, &re, 1, NULL, NULL, NULL, 0, NULL, NULL, NULL};
+    return ParseInput(data, len, &opts, result);
+}
+
+int ParseOverlay(const Config *base, const char *data, size_t len, int flags,
+                 Config **result) {
+    ParseOptions opts = {flags, NULL, 1, NULL, NULL, NULL, 0, NULL, NULL, base};
+    return ParseInput(data, len, &opts, result);
+}
+
+/* ParseConfigStream() runs the grammar of ParseConfigLine() and
+ * ParseVector() without building anything. Values are parsed onto the
+ * stack in PARSE_ZERO_COPY mode, so strings are spans of the input and
+ * the arena is never touched
+ */
+typedef struct Stream {
+    Parser Parser;
+    const ConfigCallbacks *Cb;
+    void *Userdata;
+    int Stopped; // < 0 a callback stopped the parse with, not an error
+} Stream;
+
+static int Emit(Stream *s, int status) {
+    if (status < 0)
+        s->Stopped = status;
+    return status;
+}
+
+static int StreamVector(Stream *s) {
+    // vector ::= '[' <value> (',' <value>)* ']'
+    // The '[' has already been consumed
+    Parser *p = &s->Parser;
+    const ConfigCallbacks *cb = s->Cb;
+    if (cb->OnArrayBegin && Emit(s, cb->OnArrayBegin(s->Userdata)) < 0)
+        return -1;
+
+    uint64_t length = 0;
+    int more = 1;
+    while (1) {
+        int kind = p->Tok.Kind;
+
+        if (kind == TOKEN_EOF)
+            return UNEXPECTED_EOF;
+
+        else if (kind == ']') {
+            advance(p);
+            break;
+        }
+
+        else if (kind == ',') {
+            advance(p);
+            more = 1;
+            continue;
+        }
+
+        if (!more)
+            return UNEXPECTED_TOKEN;
+
+        PrimitiveValue value;
+        if (ParsePrimitive(p, &value) < 0)
+            return INVALID_ARRAY_ELEMENT;
+        if (cb->OnElement &&
+            Emit(s, cb->OnElement(s->Userdata, length, &value)) < 0)
+            return -1;
+
+        length++;
+        more = 0;
+    }
+
+    if (cb->OnArrayEnd && Emit(s, cb->OnArrayEnd(s->Userdata, length)) < 0)
+        return -1;
+    return 1;
+}
+
+static int StreamConfigLine(Stream *s);
+
+static int StreamInclude(Stream *s) {
+    // <include> ::= "include" <quoted_string> ";", reported but not followed
+    Parser *p = &s->Parser;
+    const ConfigCallbacks *cb = s->Cb;
+    advance(p);
+    Token path = p->Tok;
+    advance(p);
+    if (expect(p, ';') < 0)
+        return p->Tok.Kind == TOKEN_EOF ? UNEXPECTED_EOF : UNEXPECTED_TOKEN;
+    if (path.Length > UINT32_MAX)
+        return INVALID_INCLUDE;
+    if (cb->OnInclude && Emit(s, cb->OnInclude(s->Userdata, path.Start,
+                                               (uint32_t)path.Length)) < 0)
+        return -1;
+    return 1;
+}
+
+static int StreamTable(Stream *s) {
+    // <table> ::= "{" <cfg>* "}"
+    // The '{' has already been consumed
+    Parser *p = &s->Parser;
+    const ConfigCallbacks *cb = s->Cb;
+    if (cb->OnTableBegin && Emit(s, cb->OnTableBegin(s->Userdata)) < 0)
+        return -1;
+
+    uint64_t entries = 0;
+    while (p->Tok.Kind != '}') {
+        int status = 1;
+        if (p->Tok.Kind == TOKEN_EOF)
+            return UNEXPECTED_EOF;
+        if (p->Tok.Kind == TOKEN_COMMENT) {
+            advance(p);
+            continue;
+        }
+        if (p->Tok.Kind != TOKEN_STRING)
+            return UNEXPECTED_TOKEN;
+        if (AtInclude(p)) {
+            status = StreamInclude(s);
+            if (status < 0)
+                return status;
+            continue;
+        }
+        status = StreamConfigLine(s);
+        if (status < 0)
+            return status;
+        entries++;
+    }
+    advance(p);
+
+    if (cb->OnTableEnd && Emit(s, cb->OnTableEnd(s->Userdata, entries)) < 0)
+        return -1;
+    return 1;
+}
+
+static int StreamConfigLine(Stream *s) {
+    // <config_line> ::= <string> "=" (<array> | <value> | <table>) ";"
+    Parser *p = &s->Parser;
+    const ConfigCallbacks *cb = s->Cb;
+    if (p->Tok.Kind != TOKEN_STRING || p->Tok.Length > UINT32_MAX)
+        return INVALID_CONFIG_KEY;
+    if (cb->OnKey && Emit(s, cb->OnKey(s->Userdata, p->Tok.Start,
+                                       (uint32_t)p->Tok.Length)) < 0)
+        return -1;
+    advance(p);
+
+    if (expect(p, '=') < 0)
+        return UNEXPECTED_TOKEN;
+
+    if (p->Tok.Kind == TOKEN_EOF)
+        return UNEXPECTED_EOF;
+
+    int status;
+    if (p->Tok.Kind == '[') {
+        advance(p);
+        status = StreamVector(s);
+    } else if (p->Tok.Kind == '{') {
+        advance(p);
+        status = StreamTable(s);
+    } else {
+        PrimitiveValue value;
+        status = ParsePrimitive(p, &value);
+        if (status > 0 && cb->OnPrimitive)
+            status = Emit(s, cb->OnPrimitive(s->Userdata, &value));
+    }
+
+    if (status < 0)
+        return status;
+
+    if (expect(p, ';') < 0)
+        return UNEXPECTED_TOKEN;
+    return 1;
+}
+
+static int SkipConfigLine(Parser *p) {
+    // A line of a key the schema does not know: check its syntax, but
+    // build nothing from it
+    static const ConfigCallbacks none;
+    Stream stream = {*p, &none, NULL, 0};
+    stream.Parser.Arena = NULL;
+    stream.Parser.Flags |= PARSE_ZERO_COPY;
+    int status = StreamConfigLine(&stream);
+    p->Lex = stream.Parser.Lex;
+    p->Tok = stream.Parser.Tok;
+    return status;
+}
+
+static int StreamConfig(const char *data, size_t len,
+                        const ConfigCallbacks *cb, void *userdata) {
+    Stream stream = {{{data, data + len, data}, {0}, NULL, PARSE_ZERO_COPY, NULL,
+                      NULL, NULL, NULL, 0},
+                     cb, userdata, 0};
+    Parser *p = &stream.Parser;
+    advance(p);
+
+    // <prog> ::= <cfg>* <EOF>
+    // <cfg> ::= <comment> | <config_line> | <include>
+    while (p->Tok.Kind != TOKEN_EOF) {
+        int status = 1;
+        if (p->Tok.Kind == TOKEN_COMMENT)
+            advance(p);
+        else if (p->Tok.Kind != TOKEN_STRING)
+            status = UNEXPECTED_TOKEN;
+        else if (AtInclude(p))
+            status = StreamInclude(&stream);
+        else
+            status = StreamConfigLine(&stream);
+
+        if (stream.Stopped)
+            return stream.Stopped;
+        if (status < 0) {
+            if (cb->OnError)
+                cb->OnError(userdata, status, (size_t)(p->Tok.Start - data));
+            return status;
+        }
+    }
+    return 1;
+}
+
+int ParseConfigStreamBuffer(const char *data, size_t len,
+                            const ConfigCallbacks *cb, void *userdata) {
+    return StreamConfig(data, len, cb, userdata);
+}
+
+int ParseConfigStream(const char *name, const ConfigCallbacks *cb,
+                      void *userdata) {
+    int fd = open(name, O_RDONLY);
+    int status = FILE_NO_ACCESS;
+    char *data;
+    size_t len;
+    int mapped = 0;
+    if (fd >= 0) {
+        status = MapInput(fd, &data, &len, &mapped);
+        close(fd);
+    }
+    if (status < 0) {
+        if (cb->OnError)
+            cb->OnError(userdata, status, 0);
+        return status;
+    }
+
+    status = StreamConfig(data, len, cb, userdata);
+    if (mapped)
+        munmap(data, len);
+    else
+        free(data);
+    return status;
+}
+
+int ParseConfig(const char *name, Config **result) {
+    return ParseConfigEx(name, 0, result);
+}
+
+/* DumpConfig() and friends format into a Writer instead of calling
+ * fprintf() per token. A Writer either flushes to a FILE* whenever it
+ * fills up, grows on demand, or fills a fixed caller buffer and keeps
+ * counting past its end, like snprintf() does
+ */
+typedef struct Writer {
+    char *Data;
+    size_t Capacity;
+    size_t Length; // bytes currently in 'Data'
+    size_t Total;  // bytes produced so far, flushed or dropped included
+    FILE *Sink;    // flush here when 'Data' fills up
+    int Growable;  // realloc() 'Data' instead
+    int Failed;    // growing failed
+} Writer;
+
+#define WRITER_CHUNK (64 * 1024)
+
+static void WriterFlush(Writer *w) {
+    if (w->Sink && w->Length)
+        fwrite(w->Data, 1, w->Length, w->Sink);
+    w->Length = 0;
+}
+
+static void WriteBytes(Writer *w, const char *src, size_t n) {
+    w->Total += n;
+    while (n > w->Capacity - w->Length) {
+        size_t room = w->Capacity - w->Length;
+        if (w->Growable && !w->Failed) {
+            size_t capacity = w->Capacity ? w->Capacity * 2 : WRITER_CHUNK;
+            while (capacity - w->Length < n)
+                capacity *= 2;
+            char *grown = realloc(w->Data, capacity);
+            if (grown) {
+                w->Data = grown;
+                w->Capacity = capacity;
+                continue;
+            }
+            w->Failed = 1;
+        }
+
+        memcpy(w->Data + w->Length, src, room);
+        w->Length += room;
+        src += room;
+        n -= room;
+        if (!w->Sink)
+            return; // out of room, drop the rest
+        WriterFlush(w);
+    }
+
+    memcpy(w->Data + w->Length, src, n);
+    w->Length += n;
+}
+
+static void WriteChar(Writer *w, char c) {
+    if (w->Length < w->Capacity) {
+        w->Data[w->Length++] = c;
+        w->Total++;
+    } else {
+        WriteBytes(w, &c, 1);
+    }
+}
+
+// Digits of 'v' end at 'end', returns where they start
+static char *FormatUnsigned(uint64_t v, char *end) {
+    do {
+        *--end = '0' + v % 10;
+        v /= 10;
+    } while (v);
+    return end;
+}
+
+static void WriteNumber(Writer *w, int64_t n) {
+    // Same output as "%ld"
+    char buf[24];
+    char *end = buf + sizeof(buf);
+    uint64_t v = n < 0 ? -(uint64_t)n : (uint64_t)n;
+    char *start = FormatUnsigned(v, end);
+    if (n < 0)
+        *--start = '-';
+    WriteBytes(w, start, end - start);
+}
+
+static void WriteDecimal(Writer *w, double d) {
+    // Same output as "%lf", i.e. exactly six digits after the point.
+    // Below 2^23 the error of d * 1e6 stays under a thousandth, so the
+    // rounding agrees with printf() unless the scaled value sits right
+    // on a half, which along with big and non finite values goes the
+    // slow way
+    double mag = d < 0 ? -d : d;
+    if (mag < 8388608.0) {
+        double scaled = mag * 1e6;
+        uint64_t whole = (uint64_t)scaled;
+        double frac = scaled - (double)whole;
+        if (frac < 0.49 || frac > 0.51) {
+            uint64_t r = whole + (frac > 0.5);
+            char buf[32];
+            char *end = buf + sizeof(buf);
+            char *start = FormatUnsigned(r % 1000000, end);
+            while (start > end - 6)
+                *--start = '0';
+            *--start = '.';
+            start = FormatUnsigned(r / 1000000, start);
+            if (signbit(d))
+                *--start = '-';
+            WriteBytes(w, start, end - start);
+            return;
+        }
+    }
+
+    char buf[512];
+    int n = snprintf(buf, sizeof(buf), "%lf", d);
+    WriteBytes(w, buf, n);
+}
+
+static void PrintPrimitive(Writer* w, PrimitiveValue* pv) {
+    switch (pv->Type) {
+        case NUMBER_TYPE: WriteNumber(w, pv->Number); break;
+        case DECIMAL_TYPE: WriteDecimal(w, pv->Decimal); break;
+        case STRING_TYPE:
+            WriteChar(w, '\'');
+            WriteBytes(w, pv->String, pv->Length);
+            WriteChar(w, '\'');
+            break;
+        default: break; // Unreachable, the parser never produces these
+    }
+}
+
+static void PrintVector(Writer* w, Vector* vec) {
+    WriteChar(w, '[');
+    for (uint64_t i = 0; i < vec->Length; i++) {
+        PrimitiveValue* v = &vec->Data[i];
+        PrintPrimitive(w, v);
+        if (i + 1 != vec->Length)
+            WriteChar(w, ',');
+    }
+    
+    WriteChar(w, ']');
+}
+
+static void WriteIndent(Writer* w, int depth) {
+    for (int i = 0; i < depth; i++)
+        WriteBytes(w, "    ", 4);
+}
+
+static void WriteEntries(Writer* w, const Config* config, int depth);
+
+static void WriteEntry(Writer* w, const ConfigEntry* ce, int depth) {
+    WriteIndent(w, depth);
+    WriteBytes(w, ce->Key, ce->KeyLength);
+    WriteBytes(w, " = ", 3);
+    Value* value = ce->Value;
+    if (ce->Type == PRIMITIVE_TYPE)
+        PrintPrimitive(w, value->Primitive);
+    else if (ce->Type == TABLE_TYPE) {
+        WriteBytes(w, "{\n", 2);
+        WriteEntries(w, value->Table, depth + 1);
+        WriteIndent(w, depth);
+        WriteChar(w, '}');
+    }
+    else {
+        PrintVector(w, value->Array);
+    }
+    WriteBytes(w, ";\n", 2);
+}
+
+// Entry for 'Key' in 'config' or the configs it overlays down to, but not
+// including, 'stop', whatever its type
+static ConfigEntry* FindOverride(const Config* config, const Config* stop,
+                                 const char* Key, size_t len) {
+    for (; config != stop; config = config->Base) {
+        ConfigEntry* ce = FindKey(config, Key, len,
+                                  HashKeySeeded(Key, len, config->HashSeed));
+        if (ce)
+            return ce;
+    }
+    return NULL;
+}
+
+static void WriteLevel(Writer* w, const Config* top, const Config* level,
+                       int depth) {
+    // Bottom up, so the output keeps the order of the base: an override
+    // is written where the first definition it replaces stood, and keys
+    // new in an overlay follow everything under it
+    if (level->Base)
+        WriteLevel(w, top, level->Base, depth);
+    for (ConfigEntry* ce = level->List; ce; ce = ce->Next) {
+        if (level->Base &&
+            FindOverride(level->Base, NULL, ce->Key, ce->KeyLength))
+            continue;
+        ConfigEntry* over = FindOverride(top, level, ce->Key, ce->KeyLength);
+        if (over && FindKey(level, ce->Key, ce->KeyLength, ce->Hash) != ce)
+            continue;
+        WriteEntry(w, over ? over : ce, depth);
+    }
+}
+
+static void WriteEntries(Writer* w, const Config* config, int depth) {
+    if (config->Base) {
+        WriteLevel(w, config, config, depth);
+        return;
+    }
+    for (ConfigEntry* ce = config->List; ce; ce = ce->Next)
+        WriteEntry(w, ce, depth);
+}
+
+static void WriteConfig(Writer* w, Config* config) {
+    WriteEntries(w, config, 0);
+}
+
+#ifdef CFG_STATS
+static void WriteStat(Writer* w, const char* name, uint64_t value) {
+    WriteBytes(w, "# ", 2);
+    WriteBytes(w, name, strlen(name));
+    WriteBytes(w, ": ", 2);
+    char digits[20];
+    char* end = digits + sizeof(digits);
+    char* start = FormatUnsigned(value, end);
+    WriteBytes(w, start, end - start);
+    WriteChar(w, '\n');
+}
+
+static void WriteStats(Writer* w, const ConfigStats* stats) {
+    // As comments, so the output still parses
+    WriteStat(w, "stats.BytesRead", stats->BytesRead);
+    WriteStat(w, "stats.Entries", stats->Entries);
+    WriteStat(w, "stats.ArrayElements", stats->ArrayElements);
+    WriteStat(w, "stats.Allocations", stats->Allocations);
+    WriteStat(w, "stats.AllocatedBytes", stats->AllocatedBytes);
+    WriteStat(w, "stats.ParseNanos", stats->ParseNanos);
+    WriteStat(w, "stats.LexNanos", stats->LexNanos);
+    WriteStat(w, "stats.ConvertNanos", stats->ConvertNanos);
+    WriteStat(w, "stats.AllocateNanos", stats->AllocateNanos);
+    WriteStat(w, "stats.Lookups", stats->Lookups);
+    WriteStat(w, "stats.Hits", stats->Hits);
+    WriteStat(w, "stats.Probes", stats->Probes);
+    if (stats->Lookups) {
+        WriteBytes(w, "# stats.AverageProbes: ", 23);
+        WriteDecimal(w, (double)stats->Probes / stats->Lookups);
+        WriteChar(w, '\n');
+    }
+}
+#endif
+
+void DumpConfig(FILE* file, Config* config) {
+    char buf[WRITER_CHUNK];
+    Writer w = {buf, sizeof(buf), 0, 0, file, 0, 0};
+    WriteConfig(&w, config);
+#ifdef CFG_STATS
+    if (config->Stats)
+        WriteStats(&w, config->Stats);
+#endif
+    WriterFlush(&w);
+}
+
+size_t DumpConfigToBuffer(Config* config, char* buf, size_t size) {
+    // Keep the last byte for the terminator
+    Writer w = {buf, size ? size - 1 : 0, 0, 0, NULL, 0, 0};
+    WriteConfig(&w, config);
+    if (size)
+        buf[w.Length] = '\0';
+    return w.Total;
+}
+
+char* DumpConfigToString(Config* config, size_t* len) {
+    Writer w = {NULL, 0, 0, 0, NULL, 1, 0};
+    WriteConfig(&w, config);
+    WriteChar(&w, '\0');
+    if (w.Failed) {
+        free(w.Data);
+        return NULL;
+    }
+    if (len)
+        *len = w.Length - 1;
+    return w.Data;
+}
+
+/* Binary snapshots. The file is a header followed by 8 byte aligned
+ * sections, all offsets being relative to the start of the file:
+ *
+ *   entries   SnapshotEntry[Entries], in list order
+ *   elements  PrimitiveValue[Elements], every vector back to back
+ *   typed     int64_t/double[Typed], the Vector::Numbers/Decimals copies
+ *   index     uint32_t[IndexMask + 1], entry number + 1 or 0 if empty
+ *   strings   every key and string value, NUL terminated
+ *
+ * Loading maps the file privately and points the Config straight into
+ * it. Only string elements are patched in place, turning their string
+ * table offset into a pointer, so pages of numeric data stay shared
+ */
+#define SNAPSHOT_MAGIC "CFGSNAP"
+#define SNAPSHOT_VERSION (1)
+#define SNAPSHOT_BYTE_ORDER (0x01020304)
+
+typedef struct SnapshotHeader {
+    char Magic[8];
+    uint32_t Version;
+    uint32_t ByteOrder;
+    uint32_t PrimitiveSize; // sizeof(PrimitiveValue) of the writer
+    uint32_t Reserved;
+    uint64_t Entries;
+    uint64_t Elements;
+    uint64_t Typed;
+    uint64_t IndexMask;
+    uint64_t StringsSize;
+    uint64_t EntriesOffset;
+    uint64_t ElementsOffset;
+    uint64_t TypedOffset;
+    uint64_t IndexOffset;
+    uint64_t StringsOffset;
+} SnapshotHeader;
+
+typedef struct SnapshotEntry {
+    uint64_t Hash;
+    uint64_t Key; // string table offset
+    uint32_t KeyLength;
+    int32_t Type;
+    // PRIMITIVE_TYPE: the value, with STRING_TYPE holding a string offset
+    // in 'Number'. ARRAY_TYPE: 'Number' is the first of 'Count' elements,
+    // whose typed copies start at 'Typed' if they have any
+    PrimitiveValue Value;
+    uint64_t Count;
+    uint64_t Typed;
+    int32_t ElementType;
+    uint32_t Reserved;
+} SnapshotEntry;
+
+static void WritePadding(Writer *w) {
+    static const char zero[8];
+    WriteBytes(w, zero, (8 - w->Total % 8) % 8);
+}
+
+// Whether any entry of 'config' is a TABLE_TYPE
+static int HasTables(const Config* config) {
+    for (ConfigEntry* ce = config->List; ce; ce = ce->Next) {
+        if (ce->Type == TABLE_TYPE)
+            return 1;
+    }
+    return 0;
+}
+
+int SaveConfigBinary(Config* config, const char* path) {
+    if (config->Entries >= UINT32_MAX)
+        return INVALID_SNAPSHOT;
+    if (config->Base)
+        return OVERLAY_NOT_SUPPORTED;
+    if (HasTables(config))
+        return TABLE_NOT_SUPPORTED;
+
+    SnapshotHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.Magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+    hdr.Version = SNAPSHOT_VERSION;
+    hdr.ByteOrder = SNAPSHOT_BYTE_ORDER;
+    hdr.PrimitiveSize = sizeof(PrimitiveValue);
+    hdr.Entries = config->Entries;
+    hdr.IndexMask = IndexCapacity(config->Entries) - 1;
+
+    for (ConfigEntry* ce = config->List; ce; ce = ce->Next) {
+        hdr.StringsSize += ce->KeyLength + 1;
+        if (ce->Type == PRIMITIVE_TYPE) {
+            if (ce->Value->Primitive->Type == STRING_TYPE)
+                hdr.StringsSize += ce->Value->Primitive->Length + 1;
+            continue;
+        }
+
+        Vector* vec = ce->Value->Array;
+        hdr.Elements += vec->Length;
+        if (vec->ElementType == NUMBER_TYPE || vec->ElementType == DECIMAL_TYPE)
+            hdr.Typed += vec->Length;
+        for (uint64_t i = 0; i < vec->Length; i++) {
+            if (vec->Data[i].Type == STRING_TYPE)
+                hdr.StringsSize += vec->Data[i].Length + 1;
+        }
+    }
+
+    hdr.EntriesOffset = sizeof(SnapshotHeader);
+    hdr.ElementsOffset = hdr.EntriesOffset + hdr.Entries * sizeof(SnapshotEntry);
+    hdr.TypedOffset = hdr.ElementsOffset + hdr.Elements * sizeof(PrimitiveValue);
+    hdr.IndexOffset = hdr.TypedOffset + hdr.Typed * sizeof(int64_t);
+    hdr.StringsOffset = hdr.IndexOffset +
+        ((hdr.IndexMask + 1) * sizeof(uint32_t) + 7) / 8 * 8;
+
+    Writer w = {NULL, 0, 0, 0, NULL, 1, 0};
+    WriteBytes(&w, (const char*)&hdr, sizeof(hdr));
+
+    // Strings are laid out in the order they are visited here
+    uint64_t strings = 0, element = 0, typed = 0;
+    for (ConfigEntry* ce = config->List; ce; ce = ce->Next) {
+        SnapshotEntry se;
+        memset(&se, 0, sizeof(se));
+        se.Hash = HashKey(ce->Key, ce->KeyLength); // unseeded, like a parse
+        se.Key = strings;
+        se.KeyLength = ce->KeyLength;
+        se.Type = ce->Type;
+        se.Typed = UINT64_MAX;
+        strings += ce->KeyLength + 1;
+
+        if (ce->Type == PRIMITIVE_TYPE) {
+            se.Value = *ce->Value->Primitive;
+            if (se.Value.Type == STRING_TYPE) {
+                se.Value.Number = strings;
+                strings += se.Value.Length + 1;
+            }
+        } else {
+            Vector* vec = ce->Value->Array;
+            se.Value.Type = ARRAY_TYPE;
+            se.Value.Number = element;
+            se.Count = vec->Length;
+            se.ElementType = vec->ElementType;
+            element += vec->Length;
+            if (vec->ElementType == NUMBER_TYPE ||
+                vec->ElementType == DECIMAL_TYPE) {
+                se.Typed = typed;
+                typed += vec->Length;
+            }
+            for (uint64_t i = 0; i < vec->Length; i++) {
+                if (vec->Data[i].Type == STRING_TYPE)
+                    strings += vec->Data[i].Length + 1;
+            }
+        }
+        WriteBytes(&w, (const char*)&se, sizeof(se));
+    }
+
+    strings = 0;
+    for (ConfigEntry* ce = config->List; ce; ce = ce->Next) {
+        if (ce->Type != ARRAY_TYPE)
+            continue;
+        Vector* vec = ce->Value->Array;
+        for (uint64_t i = 0; i < vec->Length; i++) {
+            PrimitiveValue pv = vec->Data[i];
+            if (pv.Type == STRING_TYPE) {
+                // Loading turns this back into a pointer
+                memset(&pv, 0, sizeof(pv));
+                pv.Type = STRING_TYPE;
+                pv.Length = vec->Data[i].Length;
+            }
+            WriteBytes(&w, (const char*)&pv, sizeof(pv));
+        }
+    }
+
+    for (ConfigEntry* ce = config->List; ce; ce = ce->Next) {
+        if (ce->Type != ARRAY_TYPE)
+            continue;
+        Vector* vec = ce->Value->Array;
+        if (vec->ElementType == NUMBER_TYPE || vec->ElementType == DECIMAL_TYPE)
+            WriteBytes(&w, (const char*)vec->Numbers,
+                       vec->Length * sizeof(int64_t));
+    }
+
+    // Same insertion order as BuildIndex(), so the same table comes out
+    uint32_t* slots = calloc(hdr.IndexMask + 1, sizeof(uint32_t));
+    if (!slots) {
+        free(w.Data);
+        return OUT_OF_MEMORY;
+    }
+    uint32_t ordinal = 0;
+    for (ConfigEntry* ce = config->List; ce; ce = ce->Next) {
+        uint64_t slot = HashKey(ce->Key, ce->KeyLength) & hdr.IndexMask;
+        while (slots[slot])
+            slot = (slot + 1) & hdr.IndexMask;
+        slots[slot] = ++ordinal;
+    }
+    WriteBytes(&w, (const char*)slots, (hdr.IndexMask + 1) * sizeof(uint32_t));
+    WritePadding(&w);
+    free(slots);
+
+    for (ConfigEntry* ce = config->List; ce; ce = ce->Next) {
+        WriteBytes(&w, ce->Key, ce->KeyLength);
+        WriteChar(&w, '\0');
+        if (ce->Type == PRIMITIVE_TYPE) {
+            PrimitiveValue* pv = ce->Value->Primitive;
+            if (pv->Type == STRING_TYPE) {
+                WriteBytes(&w, pv->String, pv->Length);
+                WriteChar(&w, '\0');
+            }
+            continue;
+        }
+        Vector* vec = ce->Value->Array;
+        for (uint64_t i = 0; i < vec->Length; i++) {
+            if (vec->Data[i].Type == STRING_TYPE) {
+                WriteBytes(&w, vec->Data[i].String, vec->Data[i].Length);
+                WriteChar(&w, '\0');
+            }
+        }
+    }
+
+    if (w.Failed) {
+        free(w.Data);
+        return OUT_OF_MEMORY;
+    }
+
+    // Write next to 'path' and rename over it, so that concurrent loaders
+    // see either the old snapshot or the new one, never half of one
+    size_t len = strlen(path);
+    char* tmp = malloc(len + 8);
+    if (!tmp) {
+        free(w.Data);
+        return OUT_OF_MEMORY;
+    }
+    memcpy(tmp, path, len);
+    memcpy(tmp + len, ".XXXXXX", 8);
+
+    int status = FILE_NO_ACCESS;
+    int fd = mkstemp(tmp);
+    if (fd >= 0) {
+        size_t done = 0;
+        while (done < w.Length) {
+            ssize_t n = write(fd, w.Data + done, w.Length - done);
+            if (n <= 0)
+                break;
+            done += (size_t)n;
+        }
+        if (close(fd) == 0 && done == w.Length && rename(tmp, path) == 0)
+            status = 1;
+        else
+            unlink(tmp);
+    }
+
+    free(tmp);
+    free(w.Data);
+    return status;
+}
+
+// Does [offset, offset + count * size) fit in a file of 'len' bytes?
+static int SnapshotFits(uint64_t offset, uint64_t count, uint64_t size,
+                        uint64_t len) {
+    return offset % 8 == 0 && offset <= len &&
+           count <= (len - offset) / size;
+}
+
+// Pointer to the 'length' byte string at 'offset' in the string table,
+// NULL unless it is in bounds and NUL terminated
+static char* SnapshotString(const SnapshotHeader* hdr, char* base,
+                            uint64_t offset, uint64_t length) {
+    if (offset >= hdr->StringsSize || length >= hdr->StringsSize - offset)
+        return NULL;
+    char* str = base + hdr->StringsOffset + offset;
+    return str[length] == '\0' ? str : NULL;
+}
+
+static int LoadSnapshot(Config* config, char* base, uint64_t len) {
+    const SnapshotHeader* hdr = (const SnapshotHeader*)base;
+    if (len < sizeof(SnapshotHeader) ||
+        memcmp(hdr->Magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0 ||
+        hdr->Version != SNAPSHOT_VERSION ||
+        hdr->ByteOrder != SNAPSHOT_BYTE_ORDER ||
+        hdr->PrimitiveSize != sizeof(PrimitiveValue) ||
+        hdr->Entries >= UINT32_MAX || hdr->IndexMask >= UINT32_MAX ||
+        (hdr->IndexMask & (hdr->IndexMask + 1)) != 0 ||
+        hdr->IndexMask < hdr->Entries ||
+        !SnapshotFits(hdr->EntriesOffset, hdr->Entries, sizeof(SnapshotEntry), len) ||
+        !SnapshotFits(hdr->ElementsOffset, hdr->Elements, sizeof(PrimitiveValue), len) ||
+        !SnapshotFits(hdr->TypedOffset, hdr->Typed, sizeof(int64_t), len) ||
+        !SnapshotFits(hdr->IndexOffset, hdr->IndexMask + 1, sizeof(uint32_t), len) ||
+        !SnapshotFits(hdr->StringsOffset, hdr->StringsSize, 1, len))
+        return INVALID_SNAPSHOT;
+
+    SnapshotEntry* entries = (SnapshotEntry*)(base + hdr->EntriesOffset);
+    PrimitiveValue* elements = (PrimitiveValue*)(base + hdr->ElementsOffset);
+    int64_t* typed = (int64_t*)(base + hdr->TypedOffset);
+    uint32_t* slots = (uint32_t*)(base + hdr->IndexOffset);
+
+    for (uint64_t i = 0; i < hdr->Elements; i++) {
+        PrimitiveValue* pv = &elements[i];
+        if (pv->Type == STRING_TYPE) {
+            // Saved with a zero 'Number', offsets are recovered below
+            continue;
+        }
+        if (pv->Type != NUMBER_TYPE && pv->Type != DECIMAL_TYPE)
+            return INVALID_SNAPSHOT;
+    }
+
+    // One allocation for every node of the tree
+    uint64_t slotCount = hdr->IndexMask + 1;
+    size_t size = hdr->Entries * (sizeof(ConfigEntry) + sizeof(Value) +
+                                  sizeof(PrimitiveValue) + sizeof(Vector)) +
+                  slotCount * sizeof(ConfigEntry*);
+    char* block = ArenaAlloc(config->Arena, size);
+    if (!block)
+        return OUT_OF_MEMORY;
+
+    ConfigEntry* nodes = (ConfigEntry*)block;
+    Value* values = (Value*)(nodes + hdr->Entries);
+    PrimitiveValue* primitives = (PrimitiveValue*)(values + hdr->Entries);
+    Vector* vectors = (Vector*)(primitives + hdr->Entries);
+    ConfigEntry** index = (ConfigEntry**)(vectors + hdr->Entries);
+
+    for (uint64_t i = 0; i < hdr->Entries; i++) {
+        SnapshotEntry* se = &entries[i];
+        ConfigEntry* ce = &nodes[i];
+        ce->Key = SnapshotString(hdr, base, se->Key, se->KeyLength);
+        if (!ce->Key)
+            return INVALID_SNAPSHOT;
+        ce->KeyLength = se->KeyLength;
+        ce->Hash = se->Hash;
+        ce->SourceHash = 0; // unknown, ReparseConfig() has to parse it
+        ce->Owner = config->Arena;
+        ce->Type = se->Type;
+        ce->Value = &values[i];
+        ce->Next = i + 1 < hdr->Entries ? &nodes[i + 1] : NULL;
+        // The strings of an entry follow its key, in element order
+        uint64_t strings = se->Key + se->KeyLength + 1;
+
+        if (se->Type == PRIMITIVE_TYPE) {
+            PrimitiveValue* pv = &primitives[i];
+            *pv = se->Value;
+            if (pv->Type == STRING_TYPE) {
+                pv->String = SnapshotString(hdr, base, strings, pv->Length);
+                if (!pv->String)
+                    return INVALID_SNAPSHOT;
+            } else if (pv->Type != NUMBER_TYPE && pv->Type != DECIMAL_TYPE) {
+                return INVALID_SNAPSHOT;
+            }
+            values[i].Primitive = pv;
+            values[i].Array = NULL;
+            continue;
+        }
+
+        if (se->Type != ARRAY_TYPE)
+            return INVALID_SNAPSHOT;
+
+        uint64_t first = se->Value.Number, length = se->Count;
+        Vector* vec = &vectors[i];
+        if (first > hdr->Elements || length > hdr->Elements - first)
+            return INVALID_SNAPSHOT;
+        vec->Length = vec->Capacity = length;
+        vec->Data = elements + first;
+        vec->ElementType = se->ElementType;
+        vec->Numbers = NULL;
+        // GetInt64Array() and friends trust these, as they would a parse:
+        // a typed copy iff the elements share a numeric type
+        int numeric = se->ElementType == NUMBER_TYPE ||
+                      se->ElementType == DECIMAL_TYPE;
+        if ((!numeric && se->ElementType != NULL_TYPE &&
+             se->ElementType != STRING_TYPE) ||
+            numeric != (se->Typed != UINT64_MAX))
+            return INVALID_SNAPSHOT;
+        if (numeric) {
+            if (se->Typed > hdr->Typed || length > hdr->Typed - se->Typed)
+                return INVALID_SNAPSHOT;
+            vec->Numbers = typed + se->Typed;
+        }
+
+        for (uint64_t j = 0; j < length; j++) {
+            PrimitiveValue* pv = &vec->Data[j];
+            if (se->ElementType != NULL_TYPE && pv->Type != se->ElementType)
+                return INVALID_SNAPSHOT;
+            if (pv->Type != STRING_TYPE)
+                continue;
+            pv->String = SnapshotString(hdr, base, strings, pv->Length);
+            if (!pv->String)
+                return INVALID_SNAPSHOT;
+            strings += pv->Length + 1;
+        }
+        values[i].Primitive = NULL;
+        values[i].Array = vec;
+    }
+
+    uint64_t used = 0;
+    for (uint64_t i = 0; i < slotCount; i++) {
+        index[i] = NULL;
+        if (slots[i]) {
+            if (slots[i] > hdr->Entries)
+                return INVALID_SNAPSHOT;
+            index[i] = &nodes[slots[i] - 1];
+            used++;
+        }
+    }
+    // FindValue() relies on finding an empty slot eventually
+    if (used == slotCount)
+        return INVALID_SNAPSHOT;
+
+    config->Entries = hdr->Entries;
+    config->List = hdr->Entries ? nodes : NULL;
+    config->Index = index;
+    config->IndexMask = hdr->IndexMask;
+    return 1;
+}
+
+int LoadConfigBinary(const char* path, Config** result) {
+    *result = NULL;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return FILE_NO_ACCESS;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return FILE_NO_ACCESS;
+    }
+    if ((uint64_t)st.st_size < sizeof(SnapshotHeader)) {
+        close(fd);
+        return INVALID_SNAPSHOT;
+    }
+
+    // Private and writable, for patching string pointers in place
+    size_t len = (size_t)st.st_size;
+    char* base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        return FILE_NO_ACCESS;
+
+    Config* config = NewConfig();
+    if (!config) {
+        munmap(base, len);
+        return OUT_OF_MEMORY;
+    }
+    config->Arena->Backing = base;
+    config->Arena->BackingLength = len;
+    config->Arena->BackingMapped = 1;
+
+    int status = LoadSnapshot(config, base, len);
+    if (status < 0) {
+        FreeConfig(config);
+        return status;
+    }
+
+    *result = config;
+    return 1;
+}
+
+static int NewerThan(const struct stat* a, const struct stat* b) {
+    if (a->st_mtim.tv_sec != b->st_mtim.tv_sec)
+        return a->st_mtim.tv_sec > b->st_mtim.tv_sec;
+    return a->st_mtim.tv_nsec > b->st_mtim.tv_nsec;
+}
+
+int ParseConfigCached(const char* name, const char* snapshot,
+                      Config** result) {
+    struct stat src, snap;
+    if (stat(name, &src) < 0)
+        return FILE_NO_ACCESS;
+
+    // Only a snapshot strictly newer than its source is trusted
+    if (stat(snapshot, &snap) == 0 && NewerThan(&snap, &src) &&
+        LoadConfigBinary(snapshot, result) > 0)
+        return 1;
+
+    int status = ParseConfig(name, result);
+    if (status < 0)
+        return status;
+
+    // A snapshot that cannot be written only costs the next caller time
+    SaveConfigBinary(*result, snapshot);
+    return 1;
+}
+
+/* EmbedConfig() writes a Config out as C definitions that need neither
+ * parsing nor the heap. The index is laid out like BuildIndex() does it,
+ * but over key hashes seeded with a value picked so that, wherever that
+ * is possible at all, every key sits in its home slot and a lookup never
+ * probes. Only duplicate keys cannot avoid it
+ */
+#define EMBED_SEED_TRIES (256)
+#define EMBED_MAX_GROWTH (16) // index slots per BuildIndex() slot, at most
+
+static uint64_t NextSeed(uint64_t* state) {
+    // splitmix64
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+// Entries that do not end up in their home slot
+static uint64_t Displaced(Config* config, uint64_t seed, uint64_t capacity,
+                          uint8_t* used) {
+    uint64_t displaced = 0, mask = capacity - 1;
+    memset(used, 0, capacity);
+    for (ConfigEntry* ce = config->List; ce; ce = ce->Next) {
+        uint64_t slot = HashKeySeeded(ce->Key, ce->KeyLength, seed) & mask;
+        if (used[slot]) {
+            displaced++;
+            while (used[slot])
+                slot = (slot + 1) & mask;
+        }
+        used[slot] = 1;
+    }
+    return displaced;
+}
+
+static int PickSeed(Config* config, uint64_t* seed, uint64_t* capacity) {
+    // The smallest table any seed makes perfect, else the default size
+    // with the seed that displaces the fewest entries
+    uint64_t base = IndexCapacity(config->Entries), duplicates = 0;
+    for (ConfigEntry* ce = config->List; ce; ce = ce->Next)
+        duplicates += FindKey(config, ce->Key, ce->KeyLength, ce->Hash) != ce;
+
+    uint8_t* used = malloc(base * EMBED_MAX_GROWTH);
+    if (!used)
+        return OUT_OF_MEMORY;
+
+    uint64_t state = 0, best = UINT64_MAX;
+    *seed = 0;
+    *capacity = base;
+    for (uint64_t cap = base; cap <= base * EMBED_MAX_GROWTH; cap *= 2) {
+        for (int i = 0; i < EMBED_SEED_TRIES; i++) {
+            uint64_t s = NextSeed(&state);
+            uint64_t displaced = Displaced(config, s, cap, used);
+            if (displaced == duplicates) {
+                *seed = s;
+                *capacity = cap;
+                free(used);
+                return 1;
+            }
+            if (cap == base && displaced < best) {
+                best = displaced;
+                *seed = s;
+            }
+        }
+    }
+    free(used);
+    return 1;
+}
+
+static void EmbedString(FILE* file, const char* s, size_t len) {
+    // Octal escapes are always three digits, so no digit can follow
+    // one by accident
+    fputc('"', file);
+    for (size_t i = 0; i < len; i++) {
+        unsigned char c = (unsigned char)s[i];
+        if (c >= ' ' && c <= '~' && c != '"' && c != '\\' && c != '?')
+            fputc(c, file);
+        else
+            fprintf(file, "\\%03o", c);
+    }
+    fputc('"', file);
+}
+
+static void EmbedDecimal(FILE* file, double d) {
+    // Hexadecimal floating point literals are exact
+    if (isinf(d))
+        fputs("INFINITY", file);
+    else
+        fprintf(file, "%a", d);
+}
+
+// String element 'j' of entry 'i' is called <name>_str_<i>_<j>
+static void EmbedPrimitive(FILE* file, const PrimitiveValue* pv,
+                           const char* name, uint64_t i, uint64_t j) {
+    switch (pv->Type) {
+    case NUMBER_TYPE:
+        fprintf(file, "{.Number = INT64_C(%" PRId64 "), .Type = NUMBER_TYPE}",
+                pv->Number);
+        break;
+    case DECIMAL_TYPE:
+        fputs("{.Decimal = ", file);
+        EmbedDecimal(file, pv->Decimal);
+        fputs(", .Type = DECIMAL_TYPE}", file);
+        break;
+    case STRING_TYPE:
+        fprintf(file,
+                "{.String = (char *)%s_str_%" PRIu64 "_%" PRIu64
+                ", .Type = STRING_TYPE, .Length = %" PRIu32 "}",
+                name, i, j, pv->Length);
+        break;
+    default:
+        fputs("{.Type = NULL_TYPE}", file);
+        break;
+    }
+}
+
+static void EmbedStrings(FILE* file, const PrimitiveValue* pv, uint64_t n,
+                         const char* name, uint64_t i) {
+    for (uint64_t j = 0; j < n; j++) {
+        if (pv[j].Type != STRING_TYPE)
+            continue;
+        fprintf(file, "static const char %s_str_%" PRIu64 "_%" PRIu64 "[] = ",
+                name, i, j);
+        EmbedString(file, pv[j].String, pv[j].Length);
+        fputs(";\n", file);
+    }
+}
+
+static void EmbedVector(FILE* file, const Vector* vec, const char* name,
+                        uint64_t i) {
+    EmbedStrings(file, vec->Data, vec->Length, name, i);
+    if (vec->Length) {
+        fprintf(file, "static const PrimitiveValue %s_data_%" PRIu64 "[] = {\n",
+                name, i);
+        for (uint64_t j = 0; j < vec->Length; j++) {
+            fputs("    ", file);
+            EmbedPrimitive(file, &vec->Data[j], name, i, j);
+            fputs(",\n", file);
+        }
+        fputs("};\n", file);
+    }
+
+    if (vec->Length && vec->ElementType == NUMBER_TYPE) {
+        fprintf(file, "static const int64_t %s_typed_%" PRIu64 "[] = {", name, i);
+        for (uint64_t j = 0; j < vec->Length; j++)
+            fprintf(file, "%sINT64_C(%" PRId64 ")", j ? ", " : "",
+                    vec->Numbers[j]);
+        fputs("};\n", file);
+    } else if (vec->Length && vec->ElementType == DECIMAL_TYPE) {
+        fprintf(file, "static const double %s_typed_%" PRIu64 "[] = {", name, i);
+        for (uint64_t j = 0; j < vec->Length; j++) {
+            if (j)
+                fputs(", ", file);
+            EmbedDecimal(file, vec->Decimals[j]);
+        }
+        fputs("};\n", file);
+    }
+
+    fprintf(file,
+            "static const Vector %s_vec_%" PRIu64 " = {.Length = %" PRIu64
+            ", .Capacity = %" PRIu64 ", .ElementType = %s",
+            name, i, vec->Length, vec->Length,
+            vec->ElementType == NUMBER_TYPE    ? "NUMBER_TYPE"
+            : vec->ElementType == DECIMAL_TYPE ? "DECIMAL_TYPE"
+                                               : "NULL_TYPE");
+    if (vec->Length)
+        fprintf(file, ", .Data = (PrimitiveValue *)%s_data_%" PRIu64, name, i);
+    if (vec->Length && vec->ElementType == NUMBER_TYPE)
+        fprintf(file, ", .Numbers = (int64_t *)%s_typed_%" PRIu64, name, i);
+    else if (vec->Length && vec->ElementType == DECIMAL_TYPE)
+        fprintf(file, ", .Decimals = (double *)%s_typed_%" PRIu64, name, i);
+    fputs("};\n", file);
+}
+
+int EmbedConfig(FILE* file, Config* config, const char* name) {
+    if (config->Base)
+        return OVERLAY_NOT_SUPPORTED;
+    if (HasTables(config))
+        return TABLE_NOT_SUPPORTED;
+    uint64_t seed, capacity;
+    if (PickSeed(config, &seed, &capacity) < 0)
+        return OUT_OF_MEMORY;
+
+    fprintf(file,
+            "/* Generated by EmbedConfig(), do not edit. Declare it with\n"
+            " *   extern const Config %s;\n"
+            " */\n"
+            "#include \"cfg_parse.h\"\n"
+            "#include <math.h>\n\n",
+            name);
+
+    uint64_t i = 0;
+    for (ConfigEntry* ce = config->List; ce; ce = ce->Next, i++) {
+        fprintf(file, "static const char %s_key_%" PRIu64 "[] = ", name, i);
+        EmbedString(file, ce->Key, ce->KeyLength);
+        fputs(";\n", file);
+
+        if (ce->Type == PRIMITIVE_TYPE) {
+            EmbedStrings(file, ce->Value->Primitive, 1, name, i);
+            fprintf(file, "static const PrimitiveValue %s_prim_%" PRIu64 " = ",
+                    name, i);
+            EmbedPrimitive(file, ce->Value->Primitive, name, i, 0);
+            fprintf(file,
+                    ";\nstatic const Value %s_value_%" PRIu64
+                    " = {.Primitive = (PrimitiveValue *)&%s_prim_%" PRIu64
+                    "};\n",
+                    name, i, name, i);
+        } else {
+            EmbedVector(file, ce->Value->Array, name, i);
+            fprintf(file,
+                    "static const Value %s_value_%" PRIu64
+                    " = {.Array = (Vector *)&%s_vec_%" PRIu64 "};\n",
+                    name, i, name, i);
         }
-        ce = ce->Next;
-        fprintf(file, ";\n");
     }
+
+    if (config->Entries) {
+        fprintf(file, "\nstatic const ConfigEntry %s_entries[] = {\n", name);
+        i = 0;
+        for (ConfigEntry* ce = config->List; ce; ce = ce->Next, i++) {
+            fprintf(file,
+                    "    {.Key = (char *)%s_key_%" PRIu64
+                    ", .Value = (Value *)&%s_value_%" PRIu64 ", .Next = ",
+                    name, i, name, i);
+            if (ce->Next)
+                fprintf(file, "(ConfigEntry *)&%s_entries[%" PRIu64 "]", name,
+                        i + 1);
+            else
+                fputs("NULL", file);
+            fprintf(file,
+                    ",\n     .Hash = UINT64_C(0x%016" PRIx64 "), .Type = %s"
+                    ", .KeyLength = %" PRIu32 "},\n",
+                    HashKeySeeded(ce->Key, ce->KeyLength, seed),
+                    ce->Type == ARRAY_TYPE ? "ARRAY_TYPE" : "PRIMITIVE_TYPE",
+                    ce->KeyLength);
+        }
+        fputs("};\n", file);
+    }
+
+    // Same insertion order as BuildIndex()
+    uint64_t* slots = calloc(capacity, sizeof(uint64_t));
+    if (!slots)
+        return OUT_OF_MEMORY;
+    i = 0;
+    for (ConfigEntry* ce = config->List; ce; ce = ce->Next) {
+        uint64_t slot =
+            HashKeySeeded(ce->Key, ce->KeyLength, seed) & (capacity - 1);
+        while (slots[slot])
+            slot = (slot + 1) & (capacity - 1);
+        slots[slot] = ++i;
+    }
+
+    fprintf(file, "\nstatic ConfigEntry *const %s_index[%" PRIu64 "] = {\n",
+            name, capacity);
+    for (uint64_t slot = 0; slot < capacity; slot++) {
+        if (slots[slot])
+            fprintf(file,
+                    "    [%" PRIu64 "] = (ConfigEntry *)&%s_entries[%" PRIu64
+                    "],\n",
+                    slot, name, slots[slot] - 1);
+    }
+    fputs("};\n", file);
+    free(slots);
+
+    fprintf(file,
+            "\nconst Config %s = {\n"
+            "    .Entries = %" PRIu64 ",\n"
+            "    .List = %s%s%s,\n"
+            "    .Index = (ConfigEntry **)%s_index,\n"
+            "    .IndexMask = %" PRIu64 ",\n"
+            "    .HashSeed = UINT64_C(0x%016" PRIx64 "),\n"
+            "};\n",
+            name, config->Entries, config->Entries ? "(ConfigEntry *)" : "NULL",
+            config->Entries ? name : "", config->Entries ? "_entries" : "",
+            name, capacity - 1, seed);
+
+    fflush(file);
+    return ferror(file) ? FILE_NO_ACCESS : 1;
 }
 
-void FreeConfig(Config* config) {
-    ConfigEntry* ce = config->List;
-    for (int i = 0; i < config->Entries; i++) {
-        ConfigEntry* next = ce->Next;
-        if (!ce)
-            break;
-        free(ce->Key);
-        Value* v = ce->Value;
+/* CompactConfig() copies a Config into one arena block of exactly the
+ * size it needs, measured in a first pass: the nodes, followed by a pool
+ * holding every distinct key and string once, NUL terminated and packed
+ * back to back without padding. The first pass also notes where in the
+ * pool each string it meets goes, so the second one, which meets them in
+ * the same order, need not look them up again. The copy depends on
+ * nothing of the original, neither its input nor arenas shared with
+ * other configs
+ */
+typedef struct PooledString {
+    const char* Data; // NULL for a free slot
+    uint32_t Length;
+    uint64_t Hash;
+    size_t Offset; // in the pool
+} PooledString;
+
+typedef struct Compactor {
+    size_t Nodes; // bytes of every node, rounded like ArenaAlloc() does
+    PooledString* Strings; // open addressed by hash
+    uint64_t StringMask;
+    uint64_t StringCount;
+    size_t PoolLength;
+    size_t* Offsets; // pool offset of every string met, in order
+    size_t OffsetCount;
+    size_t OffsetCapacity;
+    size_t NextOffset; // of 'Offsets' during the copy
+    char* Next; // where the next node goes
+    char* Pool;
+    Arena* Arena; // of the copy
+} Compactor;
+
+static size_t NodeSize(size_t size) {
+    return (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+static PooledString* LookupString(Compactor* c, const char* s, uint32_t len,
+                                  uint64_t hash) {
+    uint64_t slot = hash & c->StringMask;
+    PooledString* ps;
+    while ((ps = &c->Strings[slot])->Data &&
+           !(ps->Hash == hash && ps->Length == len &&
+             memcmp(ps->Data, s, len) == 0))
+        slot = (slot + 1) & c->StringMask;
+    return ps;
+}
+
+static int InternString(Compactor* c, const char* s, uint32_t len) {
+    if ((c->StringCount + 1) * 2 > c->StringMask + 1) {
+        uint64_t capacity = (c->StringMask + 1) * 2;
+        PooledString* old = c->Strings;
+        c->Strings = calloc(capacity, sizeof(PooledString));
+        if (!c->Strings) {
+            c->Strings = old;
+            return OUT_OF_MEMORY;
+        }
+        uint64_t n = c->StringMask + 1;
+        c->StringMask = capacity - 1;
+        for (uint64_t i = 0; i < n; i++) {
+            if (old[i].Data)
+                *LookupString(c, old[i].Data, old[i].Length, old[i].Hash) =
+                    old[i];
+        }
+        free(old);
+    }
+
+    if (c->OffsetCount == c->OffsetCapacity) {
+        size_t capacity = c->OffsetCapacity ? c->OffsetCapacity * 2 : 1024;
+        size_t* offsets = realloc(c->Offsets, capacity * sizeof(size_t));
+        if (!offsets)
+            return OUT_OF_MEMORY;
+        c->Offsets = offsets;
+        c->OffsetCapacity = capacity;
+    }
+
+    uint64_t hash = HashKey(s, len);
+    PooledString* ps = LookupString(c, s, len, hash);
+    if (!ps->Data) {
+        ps->Data = s;
+        ps->Length = len;
+        ps->Hash = hash;
+        ps->Offset = c->PoolLength;
+        c->PoolLength += (size_t)len + 1;
+        c->StringCount++;
+    }
+    c->Offsets[c->OffsetCount++] = ps->Offset;
+    return 1;
+}
+
+// The pool's copy of the next string InternString() met. Duplicates are
+// written over with the same bytes, which is cheaper than keeping track
+static char* PoolString(Compactor* c, const char* s, uint32_t len) {
+    char* copy = c->Pool + c->Offsets[c->NextOffset++];
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+static int MeasureEntries(Compactor* c, const Config* config) {
+    c->Nodes += NodeSize(IndexCapacity(config->Entries) * sizeof(ConfigEntry*));
+    for (ConfigEntry* ce = config->List; ce; ce = ce->Next) {
+        int status = InternString(c, ce->Key, ce->KeyLength);
+        c->Nodes += NodeSize(sizeof(ConfigEntry)) + NodeSize(sizeof(Value));
         if (ce->Type == PRIMITIVE_TYPE) {
-            PrimitiveValue* pv = v->Primitive;
-            if (pv->Type == STRING_TYPE)
-                free(pv->String);
-            free(pv);
-        }
-        else {
-            Vector* vec = v->Array;
-            for (int i = 0; i < vec->Length; i++) {
-                PrimitiveValue* pv = vec->Data[i]->Primitive;
+            PrimitiveValue* pv = ce->Value->Primitive;
+            c->Nodes += NodeSize(sizeof(PrimitiveValue));
+            if (status > 0 && pv->Type == STRING_TYPE)
+                status = InternString(c, pv->String, pv->Length);
+        } else if (ce->Type == TABLE_TYPE) {
+            c->Nodes += NodeSize(sizeof(Config));
+            if (status > 0)
+                status = MeasureEntries(c, ce->Value->Table);
+        } else {
+            Vector* vec = ce->Value->Array;
+            c->Nodes += NodeSize(sizeof(Vector)) +
+                        NodeSize(vec->Length * sizeof(PrimitiveValue));
+            if (vec->ElementType == NUMBER_TYPE ||
+                vec->ElementType == DECIMAL_TYPE)
+                c->Nodes += NodeSize(vec->Length * sizeof(int64_t));
+            for (uint64_t i = 0; status > 0 && i < vec->Length; i++) {
+                PrimitiveValue* pv = &vec->Data[i];
                 if (pv->Type == STRING_TYPE)
-                free(pv->String);
-                free(pv);
-                free(vec->Data[i]);
+                    status = InternString(c, pv->String, pv->Length);
             }
-            free(vec->Data);
-            free(vec);
         }
+        if (status < 0)
+            return status;
+    }
+    return 1;
+}
 
-        free(v);
-        free(ce);
+static void* TakeNode(Compactor* c, size_t size) {
+    void* node = c->Next;
+    c->Next += NodeSize(size);
+    return node;
+}
 
-        if (next)
-            ce = next;
-        else
-            break;
+static void CopyPrimitive(Compactor* c, PrimitiveValue* to,
+                          const PrimitiveValue* from) {
+    *to = *from;
+    if (from->Type == STRING_TYPE)
+        to->String = PoolString(c, from->String, from->Length);
+}
+
+static void CopyVector(Compactor* c, Vector* to, const Vector* from) {
+    to->Length = from->Length;
+    to->Capacity = from->Length;
+    to->ElementType = from->ElementType;
+    to->Data = from->Length ? TakeNode(c, from->Length * sizeof(PrimitiveValue))
+                            : NULL;
+    for (uint64_t i = 0; i < from->Length; i++)
+        CopyPrimitive(c, &to->Data[i], &from->Data[i]);
+
+    to->Numbers = NULL;
+    if (to->ElementType == NUMBER_TYPE || to->ElementType == DECIMAL_TYPE) {
+        // Both are 8 bytes, a copy of either is a copy of the other
+        to->Numbers = TakeNode(c, from->Length * sizeof(int64_t));
+        memcpy(to->Numbers, from->Numbers, from->Length * sizeof(int64_t));
+    }
+}
+
+static void CopyEntries(Compactor* c, Config* to, const Config* from) {
+    uint64_t capacity = IndexCapacity(from->Entries);
+    to->Index = TakeNode(c, capacity * sizeof(ConfigEntry*));
+    to->IndexMask = capacity - 1;
+    to->HashSeed = from->HashSeed;
+    to->Entries = from->Entries;
+
+    ConfigEntry** tail = &to->List;
+    for (ConfigEntry* ce = from->List; ce; ce = ce->Next) {
+        ConfigEntry* copy = TakeNode(c, sizeof(ConfigEntry));
+        *copy = *ce;
+        copy->Key = PoolString(c, ce->Key, ce->KeyLength);
+        copy->Owner = c->Arena;
+        copy->Next = NULL;
+        copy->Value = TakeNode(c, sizeof(Value));
+        memset(copy->Value, 0, sizeof(Value));
+
+        if (ce->Type == PRIMITIVE_TYPE) {
+            copy->Value->Primitive = TakeNode(c, sizeof(PrimitiveValue));
+            CopyPrimitive(c, copy->Value->Primitive, ce->Value->Primitive);
+        } else if (ce->Type == TABLE_TYPE) {
+            Config* table = TakeNode(c, sizeof(Config));
+            memset(table, 0, sizeof(Config));
+            table->Arena = c->Arena;
+            CopyEntries(c, table, ce->Value->Table);
+            copy->Value->Table = table;
+        } else {
+            copy->Value->Array = TakeNode(c, sizeof(Vector));
+            CopyVector(c, copy->Value->Array, ce->Value->Array);
+        }
+        *tail = copy;
+        tail = &copy->Next;
+    }
+    FillIndex(to);
+}
+
+int CompactConfig(const Config* config, Config** result) {
+    *result = NULL;
+    Compactor c;
+    memset(&c, 0, sizeof(c));
+    // Keys are mostly distinct, so there are at least about as many
+    // strings as entries
+    c.StringMask = IndexCapacity(config->Entries) - 1;
+    c.Strings = calloc(c.StringMask + 1, sizeof(PooledString));
+    if (!c.Strings)
+        return OUT_OF_MEMORY;
+
+    int status = MeasureEntries(&c, config);
+    Config* compact = NULL;
+    char* block = NULL;
+    if (status > 0) {
+        compact = NewConfig();
+        if (compact) {
+            // Nothing but this block is ever allocated from the arena
+            compact->Arena->FirstBlock = c.Nodes + c.PoolLength;
+            block = ArenaAlloc(compact->Arena, c.Nodes + c.PoolLength);
+        }
+        if (!block)
+            status = OUT_OF_MEMORY;
+    }
+
+    if (status > 0) {
+        c.Next = block;
+        c.Pool = block + c.Nodes;
+        c.Arena = compact->Arena;
+        CopyEntries(&c, compact, config);
+        compact->Base = config->Base;
+#ifdef CFG_STATS
+        if (config->Stats)
+            *compact->Stats = *config->Stats;
+#endif
+        *result = compact;
+    } else if (compact) {
+        FreeConfig(compact);
+    }
+    free(c.Strings);
+    free(c.Offsets);
+    return status;
+}
+
+// Adds what 'arena' takes up (itself, its blocks and its input) to 'usage'
+static void MeasureArena(const Arena* arena, ConfigMemory* usage) {
+    usage->Overhead += sizeof(Arena) + arena->KeptCapacity * sizeof(Arena*);
+    usage->Allocations += 1 + (arena->Kept != NULL);
+    for (ArenaBlock* block = arena->Head; block; block = block->Next) {
+        usage->Nodes += block->Used;
+        usage->Overhead += sizeof(ArenaBlock) + block->Size - block->Used;
+        usage->Allocations++;
+    }
+    if (arena->Backing) {
+        usage->Input += arena->BackingLength;
+        usage->Allocations++;
+    }
+}
+
+int ConfigMemoryUsage(const Config* config, ConfigMemory* usage) {
+    memset(usage, 0, sizeof(ConfigMemory));
+    if (!config->Arena)
+        return 1; // from EmbedConfig(), nothing but constants
+
+    usage->Overhead = sizeof(Config);
+    usage->Allocations = 1;
+    MeasureArena(config->Arena, usage);
+
+    // Kept arenas may keep others in turn, and several may keep the same
+    // one, so walk them breadth first and count each once
+    const Arena** seen = NULL;
+    uint32_t count = 0, capacity = 0;
+    const Arena* arena = config->Arena;
+    for (uint32_t next = 0; arena; arena = next < count ? seen[next++] : NULL) {
+        for (uint32_t i = 0; i < arena->KeptCount; i++) {
+            const Arena* kept = arena->Kept[i];
+            uint32_t j = 0;
+            while (j < count && seen[j] != kept)
+                j++;
+            if (j < count || kept == config->Arena)
+                continue;
+            if (count == capacity) {
+                capacity = capacity ? capacity * 2 : 8;
+                const Arena** grown = realloc(seen, capacity * sizeof(Arena*));
+                if (!grown) {
+                    free(seen);
+                    return OUT_OF_MEMORY;
+                }
+                seen = grown;
+            }
+            seen[count++] = kept;
+
+            ConfigMemory shared;
+            memset(&shared, 0, sizeof(shared));
+            MeasureArena(kept, &shared);
+            usage->Shared += shared.Nodes + shared.Overhead + shared.Input;
+            usage->Allocations += shared.Allocations;
+        }
     }
+    free(seen);
+
+    usage->Total =
+        usage->Nodes + usage->Overhead + usage->Input + usage->Shared;
+    return 1;
+}
 
+void FreeConfig(Config* config) {
+    // Every node lives in the arena, so there is nothing to walk
+    ArenaRelease(config->Arena);
     free(config);
 }
 
-Value* FindValue(Config* config, int ty, const char* Key) {
-    ConfigEntry* ce = config->List;
-    for (int i = 0; i < config->Entries; i++) {
-        if (strcmp(ce->Key, Key) == 0 && ce->Type == ty)
+static Value* FindOverlayValue(const Config* config, int ty, const char* Key,
+                               size_t len, uint64_t hash);
+
+static Value* FindValueHashed(const Config* config, int ty, const char* Key,
+                              size_t len, uint64_t hash) {
+    if (config->Base)
+        return FindOverlayValue(config, ty, Key, len, hash);
+    // Keys need not be terminated (PARSE_ZERO_COPY), compare lengths first
+    uint64_t slot = hash & config->IndexMask;
+#ifdef CFG_STATS
+    // Lookups may come from many threads at once
+    ConfigStats* stats = config->Stats;
+    uint64_t probes = 1;
+    Value* found = NULL;
+    while (1) {
+        ConfigEntry* ce = config->Index[slot];
+        if (!ce)
+            break;
+        if (ce->Hash == hash && ce->Type == ty && ce->KeyLength == len &&
+            memcmp(ce->Key, Key, len) == 0) {
+            found = ce->Value;
+            break;
+        }
+        slot = (slot + 1) & config->IndexMask;
+        probes++;
+    }
+    if (stats) {
+        STAT_ATOMIC_ADD(Lookups, 1);
+        STAT_ATOMIC_ADD(Hits, found != NULL);
+        STAT_ATOMIC_ADD(Probes, probes);
+    }
+    return found;
+#else
+    while (1) {
+        ConfigEntry* ce = config->Index[slot];
+        if (!ce)
+            return NULL;
+        if (ce->Hash == hash && ce->Type == ty && ce->KeyLength == len &&
+            memcmp(ce->Key, Key, len) == 0)
             return ce->Value;
-        ce = ce->Next;
+        slot = (slot + 1) & config->IndexMask;
+    }
+#endif
+}
+
+static Value* FindOverlayValue(const Config* config, int ty, const char* Key,
+                               size_t len, uint64_t hash) {
+    // An override hides the base's entries for its key, even those of
+    // other types. Only the bottom config may have a seed of its own
+    for (; config->Base; config = config->Base) {
+        ConfigEntry* ce = FindKey(config, Key, len, hash);
+        if (ce)
+            return ce->Type == ty ? ce->Value : NULL;
+        if (config->Base->HashSeed != config->HashSeed)
+            hash = HashKeySeeded(Key, len, config->Base->HashSeed);
+    }
+    return FindValueHashed(config, ty, Key, len, hash);
+}
+
+Value* FindValue(const Config* config, int ty, const char* Key) {
+    size_t len = strlen(Key);
+    return FindValueHashed(config, ty, Key, len,
+                           HashKeySeeded(Key, len, config->HashSeed));
+}
+
+Config* FindSection(const Config* config, const char* Key) {
+    Value* v = FindValue(config, TABLE_TYPE, Key);
+    return v ? v->Table : NULL;
+}
+
+int GetConfigStats(const Config* config, ConfigStats* stats) {
+    memset(stats, 0, sizeof(ConfigStats));
+    if (!config->Stats)
+        return 0;
+    // A snapshot of counters other threads may still be bumping
+    const uint64_t* from = (const uint64_t*)config->Stats;
+    uint64_t* to = (uint64_t*)stats;
+    for (size_t i = 0; i < sizeof(ConfigStats) / sizeof(uint64_t); i++)
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+    return 1;
+}
+
+// Keys resolved per round of FindValues(). Enough to overlap the misses,
+// few enough for the lengths and hashes to stay in registers and L1
+#define FIND_BATCH (16)
+
+size_t FindValues(const Config* config, const char** keys, const int* types,
+                  size_t n, Value** out) {
+    // Hash a whole round first and prefetch its index slots, then the
+    // entries they point at, so the cache misses of a round overlap
+    // instead of being paid one lookup at a time
+    size_t found = 0;
+    for (size_t base = 0; base < n; base += FIND_BATCH) {
+        size_t count = n - base < FIND_BATCH ? n - base : FIND_BATCH;
+        size_t len[FIND_BATCH];
+        uint64_t hash[FIND_BATCH];
+        for (size_t i = 0; i < count; i++) {
+            len[i] = strlen(keys[base + i]);
+            hash[i] = HashKeySeeded(keys[base + i], len[i], config->HashSeed);
+            __builtin_prefetch(&config->Index[hash[i] & config->IndexMask]);
+        }
+        for (size_t i = 0; i < count; i++) {
+            ConfigEntry* ce = config->Index[hash[i] & config->IndexMask];
+            if (ce)
+                __builtin_prefetch(ce);
+        }
+        for (size_t i = 0; i < count; i++) {
+            Value* v = FindValueHashed(config, types[base + i], keys[base + i],
+                                       len[i], hash[i]);
+            out[base + i] = v;
+            found += v != NULL;
+        }
+    }
+    return found;
+}
+
+KeyRegistry* CreateKeyRegistry(void) {
+    KeyRegistry* reg = malloc(sizeof(KeyRegistry));
+    if (!reg)
+        return NULL;
+    reg->Count = 0;
+    reg->Capacity = 0;
+    reg->Keys = NULL;
+    return reg;
+}
+
+LookupHandle RegisterKey(KeyRegistry* reg, int ty, const char* Key) {
+    // Registration is a startup affair, a linear scan is plenty
+    size_t len = strlen(Key);
+    uint64_t hash = HashKey(Key, len);
+    for (uint32_t i = 0; i < reg->Count; i++) {
+        RegisteredKey* rk = &reg->Keys[i];
+        if (rk->Hash == hash && rk->Type == ty && strcmp(rk->Key, Key) == 0)
+            return i;
+    }
+
+    if (reg->Count == INVALID_LOOKUP_HANDLE)
+        return INVALID_LOOKUP_HANDLE;
+
+    if (reg->Count == reg->Capacity) {
+        uint32_t capacity = reg->Capacity ? reg->Capacity * 2 : 16;
+        RegisteredKey* keys = realloc(reg->Keys, capacity * sizeof(RegisteredKey));
+        if (!keys)
+            return INVALID_LOOKUP_HANDLE;
+        reg->Keys = keys;
+        reg->Capacity = capacity;
+    }
+
+    char* copy = strdup(Key);
+    if (!copy)
+        return INVALID_LOOKUP_HANDLE;
+
+    RegisteredKey* rk = &reg->Keys[reg->Count];
+    rk->Key = copy;
+    rk->Length = len;
+    rk->Hash = hash;
+    rk->Type = ty;
+    return reg->Count++;
+}
+
+int BindKeys(Config* config, const KeyRegistry* reg) {
+    // Resolve every registered key once, so that GetValueByHandle()
+    // is a plain array load afterwards
+    Value** bound = NULL;
+    if (reg->Count) {
+        bound = ArenaAlloc(config->Arena, reg->Count * sizeof(Value*));
+        if (!bound)
+            return OUT_OF_MEMORY;
+    }
+
+    for (uint32_t i = 0; i < reg->Count; i++) {
+        RegisteredKey* rk = &reg->Keys[i];
+        uint64_t hash = config->HashSeed
+                            ? HashKeySeeded(rk->Key, rk->Length, config->HashSeed)
+                            : rk->Hash;
+        bound[i] = FindValueHashed(config, rk->Type, rk->Key, rk->Length, hash);
+    }
+
+    config->Bound = bound;
+    config->BoundCount = reg->Count;
+    return 1;
+}
+
+Value* GetValueByHandle(Config* config, LookupHandle handle) {
+    if (handle >= config->BoundCount)
+        return NULL;
+    return config->Bound[handle];
+}
+
+void FreeKeyRegistry(KeyRegistry* reg) {
+    for (uint32_t i = 0; i < reg->Count; i++)
+        free(reg->Keys[i].Key);
+    free(reg->Keys);
+    free(reg);
+}
+
+ConfigSchema* CreateConfigSchema(int flags) {
+    ConfigSchema* schema = malloc(sizeof(ConfigSchema));
+    if (!schema)
+        return NULL;
+    schema->Keys = NULL;
+    schema->Count = 0;
+    schema->Capacity = 0;
+    schema->Index = NULL;
+    schema->IndexMask = 0;
+    schema->Flags = flags;
+    return schema;
+}
+
+static int IndexSchema(ConfigSchema* schema) {
+    // Rebuilt as keys are declared, declaring is a startup affair
+    uint64_t capacity = IndexCapacity(schema->Count);
+    uint32_t* index = calloc(capacity, sizeof(uint32_t));
+    if (!index)
+        return OUT_OF_MEMORY;
+    for (uint32_t i = 0; i < schema->Count; i++) {
+        uint64_t slot = schema->Keys[i].Hash & (capacity - 1);
+        while (index[slot])
+            slot = (slot + 1) & (capacity - 1);
+        index[slot] = i + 1;
+    }
+    free(schema->Index);
+    schema->Index = index;
+    schema->IndexMask = capacity - 1;
+    return 1;
+}
+
+int AddSchemaKey(ConfigSchema* schema, const char* Key, int ty, int valueType,
+                 int flags) {
+    size_t len = strlen(Key);
+    SchemaKey* sk = (SchemaKey*)FindSchemaKey(schema, Key, len, ty);
+    if (!sk) {
+        if (schema->Count == schema->Capacity) {
+            uint32_t capacity = schema->Capacity ? schema->Capacity * 2 : 16;
+            SchemaKey* keys = realloc(schema->Keys, capacity * sizeof(SchemaKey));
+            if (!keys)
+                return OUT_OF_MEMORY;
+            schema->Keys = keys;
+            schema->Capacity = capacity;
+        }
+
+        char* copy = strdup(Key);
+        if (!copy)
+            return OUT_OF_MEMORY;
+        sk = &schema->Keys[schema->Count++];
+        sk->Key = copy;
+        sk->Length = len;
+        sk->Hash = HashKey(Key, len);
+        sk->Type = ty;
+        if (IndexSchema(schema) < 0) {
+            free(copy);
+            schema->Count--;
+            return OUT_OF_MEMORY;
+        }
+    }
+
+    sk->ValueType = valueType;
+    sk->Flags = flags & ~SCHEMA_RANGE;
+    sk->Min = -HUGE_VAL;
+    sk->Max = HUGE_VAL;
+    return 1;
+}
+
+int SetSchemaRange(ConfigSchema* schema, const char* Key, int ty, double min,
+                   double max) {
+    SchemaKey* sk = (SchemaKey*)FindSchemaKey(schema, Key, strlen(Key), ty);
+    if (!sk)
+        return SCHEMA_UNKNOWN_KEY;
+    sk->Flags |= SCHEMA_RANGE;
+    sk->Min = min;
+    sk->Max = max;
+    return 1;
+}
+
+void FreeConfigSchema(ConfigSchema* schema) {
+    for (uint32_t i = 0; i < schema->Count; i++)
+        free(schema->Keys[i].Key);
+    free(schema->Keys);
+    free(schema->Index);
+    free(schema);
+}
+
+// Publishing is hazard pointer based: a reader announces the Config it is
+// about to use in its own slot, then checks that it is still the current
+// one. A publisher swaps the pointer first and only frees a retired Config
+// once no slot names it. Readers never wait for anyone
+struct ConfigReader {
+    Config* Hazard; // what this reader is using, NULL if nothing
+    int Active; // slot is claimed by a thread
+    struct ConfigReader* Next;
+};
+
+typedef struct RetiredConfig {
+    Config* Config;
+    struct RetiredConfig* Next;
+} RetiredConfig;
+
+struct ConfigSnapshot {
+    Config* Current;
+    ConfigReader* Readers; // only ever grows, slots are reused
+    RetiredConfig* Retired; // replaced but maybe still in use
+};
+
+ConfigSnapshot* CreateConfigSnapshot(Config* config) {
+    ConfigSnapshot* snap = malloc(sizeof(ConfigSnapshot));
+    if (!snap)
+        return NULL;
+    snap->Current = config;
+    snap->Readers = NULL;
+    snap->Retired = NULL;
+    return snap;
+}
+
+ConfigReader* RegisterConfigReader(ConfigSnapshot* snap) {
+    ConfigReader* reader = __atomic_load_n(&snap->Readers, __ATOMIC_ACQUIRE);
+    for (; reader; reader = reader->Next) {
+        int idle = 0;
+        if (__atomic_compare_exchange_n(&reader->Active, &idle, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return reader;
+    }
+
+    reader = malloc(sizeof(ConfigReader));
+    if (!reader)
+        return NULL;
+    reader->Hazard = NULL;
+    reader->Active = 1;
+    reader->Next = __atomic_load_n(&snap->Readers, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&snap->Readers, &reader->Next, reader,
+                                        0, __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+    return reader;
+}
+
+void UnregisterConfigReader(ConfigReader* reader) {
+    __atomic_store_n(&reader->Hazard, NULL, __ATOMIC_RELEASE);
+    __atomic_store_n(&reader->Active, 0, __ATOMIC_RELEASE);
+}
+
+Config* AcquireConfig(ConfigSnapshot* snap, ConfigReader* reader) {
+    // Announcing and re-checking must not be reordered, hence seq_cst.
+    // Retries only when a publish happened in between
+    Config* config = __atomic_load_n(&snap->Current, __ATOMIC_ACQUIRE);
+    while (1) {
+        __atomic_store_n(&reader->Hazard, config, __ATOMIC_SEQ_CST);
+        Config* now = __atomic_load_n(&snap->Current, __ATOMIC_SEQ_CST);
+        if (now == config)
+            return config;
+        config = now;
+    }
+}
+
+void ReleaseConfig(ConfigReader* reader) {
+    __atomic_store_n(&reader->Hazard, NULL, __ATOMIC_RELEASE);
+}
+
+static int InUse(ConfigSnapshot* snap, Config* config) {
+    ConfigReader* reader = __atomic_load_n(&snap->Readers, __ATOMIC_ACQUIRE);
+    for (; reader; reader = reader->Next) {
+        if (__atomic_load_n(&reader->Hazard, __ATOMIC_SEQ_CST) == config)
+            return 1;
+    }
+    return 0;
+}
+
+static void RetireConfig(ConfigSnapshot* snap, RetiredConfig* node) {
+    node->Next = __atomic_load_n(&snap->Retired, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&snap->Retired, &node->Next, node, 0,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+}
+
+int PublishConfig(ConfigSnapshot* snap, Config* config) {
+    // Allocate up front, so that a failure leaves everything as it was
+    RetiredConfig* node = malloc(sizeof(RetiredConfig));
+    if (!node)
+        return OUT_OF_MEMORY;
+    node->Config = __atomic_exchange_n(&snap->Current, config, __ATOMIC_SEQ_CST);
+    if (node->Config)
+        RetireConfig(snap, node);
+    else
+        free(node);
+
+    // Take the whole list, so concurrent publishers never see the same
+    // node, and free whatever no reader holds on to anymore
+    RetiredConfig* retired = __atomic_exchange_n(&snap->Retired, NULL,
+                                                 __ATOMIC_ACQUIRE);
+    while (retired) {
+        RetiredConfig* next = retired->Next;
+        if (InUse(snap, retired->Config)) {
+            RetireConfig(snap, retired);
+        } else {
+            FreeConfig(retired->Config);
+            free(retired);
+        }
+        retired = next;
+    }
+    return 1;
+}
+
+void DestroyConfigSnapshot(ConfigSnapshot* snap) {
+    if (snap->Current)
+        FreeConfig(snap->Current);
+    for (RetiredConfig* r = snap->Retired, *next; r; r = next) {
+        next = r->Next;
+        FreeConfig(r->Config);
+        free(r);
+    }
+    for (ConfigReader* reader = snap->Readers, *next; reader; reader = next) {
+        next = reader->Next;
+        free(reader);
+    }
+    free(snap);
+}
+
+/* A ConfigWatcher is one background thread waiting on inotify (or, where
+ * there is none, polling stat()) for changes to its file. It watches the
+ * directory rather than the file, so editors and deploy tools replacing
+ * the file by a rename are seen too, and the file may be missing for a
+ * while. Every event restarts the debounce timer; the reparse only starts
+ * once the file stayed quiet for that long. Reparsing goes through
+ * ReparseConfig() against the published Config, holding a reader slot of
+ * its own so a concurrent publisher cannot free it underneath
+ */
+struct ConfigWatcher {
+    ConfigSnapshot* Snapshot;
+    ConfigReader* Reader;
+    char* Name;
+    const char* Base; // file name part of 'Name'
+    int Flags;
+    const KeyRegistry* Registry; // bound to every reload, NULL for none
+    int Debounce; // milliseconds
+    ConfigChangeFn OnChange;
+    void* Userdata;
+    int Notify; // inotify descriptor, -1 if polling
+    int Wake[2]; // pipe StopConfigWatcher() writes to
+    struct stat Last; // of 'Name' as last reloaded, when polling
+    int Status; // of the last reload, 0 if none yet
+    uint64_t Reloads;
+    pthread_t Thread;
+};
+
+static uint64_t MonotonicMillis(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void Reload(ConfigWatcher* w) {
+    Config* config = NULL;
+    Config* old = AcquireConfig(w->Snapshot, w->Reader);
+    int status = old ? ReparseConfig(old, w->Name, w->Flags, &config,
+                                     w->OnChange, w->Userdata)
+                     : ParseConfigEx(w->Name, w->Flags, &config);
+    ReleaseConfig(w->Reader);
+
+    // A failed parse leaves the current Config published. Keys are bound
+    // first, readers may look them up as soon as the Config is out
+    if (status > 0 && w->Registry)
+        status = BindKeys(config, w->Registry);
+    if (status > 0)
+        status = PublishConfig(w->Snapshot, config);
+    if (status < 0 && config)
+        FreeConfig(config);
+    __atomic_store_n(&w->Status, status, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&w->Reloads, 1, __ATOMIC_RELEASE);
+}
+
+// Whether anything read from 'w->Notify' concerns the watched file. When
+// polling, whether the file looks different from the last reload
+static int Changed(ConfigWatcher* w) {
+#ifdef __linux__
+    if (w->Notify >= 0) {
+        alignas(struct inotify_event) char buf[4096];
+        int changed = 0;
+        ssize_t n;
+        while ((n = read(w->Notify, buf, sizeof(buf))) > 0) {
+            for (char* at = buf; at < buf + n;) {
+                struct inotify_event* ev = (struct inotify_event*)at;
+                if ((ev->len && strcmp(ev->name, w->Base) == 0) ||
+                    (ev->mask & IN_Q_OVERFLOW))
+                    changed = 1;
+                at += sizeof(struct inotify_event) + ev->len;
+            }
+        }
+        return changed;
     }
+#endif
+    struct stat st;
+    if (stat(w->Name, &st) < 0 || SameFile(&st, &w->Last))
+        return 0;
+    w->Last = st;
+    return 1;
+}
+
+static void* WatchLoop(void* arg) {
+    ConfigWatcher* w = arg;
+    struct pollfd fds[2] = {{w->Wake[0], POLLIN, 0}, {w->Notify, POLLIN, 0}};
+    nfds_t nfds = w->Notify >= 0 ? 2 : 1;
+    int pending = 0;
+    uint64_t deadline = 0;
+    while (1) {
+        int timeout = w->Debounce;
+        if (pending) {
+            uint64_t now = MonotonicMillis();
+            timeout = deadline > now ? (int)(deadline - now) : 0;
+        } else if (nfds == 2) {
+            timeout = -1;
+        }
+        if (poll(fds, nfds, timeout) < 0)
+            continue; // EINTR
+        if (fds[0].revents)
+            break;
 
+        if (nfds == 1 || fds[1].revents) {
+            if (Changed(w)) {
+                pending = 1;
+                deadline = MonotonicMillis() + w->Debounce;
+                continue;
+            }
+        }
+        if (pending && MonotonicMillis() >= deadline) {
+            pending = 0;
+            Reload(w);
+        }
+    }
     return NULL;
 }
 
+static void FreeWatcher(ConfigWatcher* w) {
+    if (w->Notify >= 0)
+        close(w->Notify);
+    if (w->Wake[0] >= 0) {
+        close(w->Wake[0]);
+        close(w->Wake[1]);
+    }
+    if (w->Reader)
+        UnregisterConfigReader(w->Reader);
+    free(w->Name);
+    free(w);
+}
+
+ConfigWatcher* WatchConfig(ConfigSnapshot* snap, const char* name, int flags,
+                           const KeyRegistry* reg, int debounceMillis,
+                           ConfigChangeFn fn, void* userdata) {
+    ConfigWatcher* w = calloc(1, sizeof(ConfigWatcher));
+    if (!w)
+        return NULL;
+    w->Snapshot = snap;
+    w->Flags = flags;
+    w->Registry = reg;
+    w->Debounce = debounceMillis > 0 ? debounceMillis : 1;
+    w->OnChange = fn;
+    w->Userdata = userdata;
+    w->Notify = -1;
+    w->Wake[0] = w->Wake[1] = -1;
+    w->Name = strdup(name);
+    w->Reader = RegisterConfigReader(snap);
+    if (!w->Name || !w->Reader || pipe(w->Wake) < 0) {
+        FreeWatcher(w);
+        return NULL;
+    }
+    const char* slash = strrchr(w->Name, '/');
+    w->Base = slash ? slash + 1 : w->Name;
+
+#ifdef __linux__
+    w->Notify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (w->Notify >= 0) {
+        // Watch the directory, the file itself may be replaced or missing
+        char* dir = slash ? strndup(w->Name, slash == w->Name ? 1
+                                                 : slash - w->Name)
+                          : strdup(".");
+        uint32_t mask = IN_CLOSE_WRITE | IN_MODIFY | IN_MOVED_TO | IN_CREATE |
+                        IN_DELETE | IN_ATTRIB;
+        if (!dir || inotify_add_watch(w->Notify, dir, mask) < 0) {
+            close(w->Notify);
+            w->Notify = -1;
+        }
+        free(dir);
+    }
+#endif
+    if (w->Notify < 0)
+        stat(w->Name, &w->Last);
+
+    if (pthread_create(&w->Thread, NULL, WatchLoop, w) != 0) {
+        FreeWatcher(w);
+        return NULL;
+    }
+    return w;
+}
+
+int ConfigWatcherStatus(const ConfigWatcher* w, uint64_t* reloads) {
+    if (reloads)
+        *reloads = __atomic_load_n(&w->Reloads, __ATOMIC_ACQUIRE);
+    return __atomic_load_n(&w->Status, __ATOMIC_ACQUIRE);
+}
+
+void StopConfigWatcher(ConfigWatcher* w) {
+    char c = 0;
+    while (write(w->Wake[1], &c, 1) < 0)
+        ;
+    pthread_join(w->Thread, NULL);
+    FreeWatcher(w);
+}
+
 PrimitiveValue* GetElement(Vector* v, uint64_t idx) {
     if (v->Length <= idx)
         return NULL;
-    return v->Data[idx]->Primitive;
+    return &v->Data[idx];
+}
+
+int64_t* GetNumbers(Vector* v) {
+    return v->ElementType == NUMBER_TYPE ? v->Numbers : NULL;
+}
+
+double* GetDecimals(Vector* v) {
+    return v->ElementType == DECIMAL_TYPE ? v->Decimals : NULL;
+}
+
+// The primitive 'Key' holds, iff it is of type 'ty'
+static const PrimitiveValue* FindPrimitive(const Config* config,
+                                           const char* Key, int ty) {
+    Value* v = FindValue(config, PRIMITIVE_TYPE, Key);
+    return v && v->Primitive->Type == ty ? v->Primitive : NULL;
+}
+
+// The array 'Key' holds, iff all of its elements are of type 'ty'
+static const Vector* FindTypedArray(const Config* config, const char* Key,
+                                    int ty) {
+    Value* v = FindValue(config, ARRAY_TYPE, Key);
+    if (!v || (v->Array->Length && v->Array->ElementType != ty))
+        return NULL;
+    return v->Array;
+}
+
+int GetInt64(const Config* config, const char* Key, int64_t* out) {
+    const PrimitiveValue* pv = FindPrimitive(config, Key, NUMBER_TYPE);
+    if (!pv)
+        return 0;
+    *out = pv->Number;
+    return 1;
+}
+
+int GetDouble(const Config* config, const char* Key, double* out) {
+    const PrimitiveValue* pv = FindPrimitive(config, Key, DECIMAL_TYPE);
+    if (!pv)
+        return 0;
+    *out = pv->Decimal;
+    return 1;
+}
+
+int GetString(const Config* config, const char* Key, const char** out,
+              uint32_t* len) {
+    const PrimitiveValue* pv = FindPrimitive(config, Key, STRING_TYPE);
+    if (!pv)
+        return 0;
+    *out = pv->String;
+    *len = pv->Length;
+    return 1;
+}
+
+int GetInt64Array(const Config* config, const char* Key, const int64_t** out,
+                  uint64_t* len) {
+    const Vector* vec = FindTypedArray(config, Key, NUMBER_TYPE);
+    if (!vec)
+        return 0;
+    // Built by FlattenVector(), no element needs looking at
+    *out = vec->Length ? vec->Numbers : NULL;
+    *len = vec->Length;
+    return 1;
+}
+
+int GetDoubleArray(const Config* config, const char* Key, const double** out,
+                   uint64_t* len) {
+    const Vector* vec = FindTypedArray(config, Key, DECIMAL_TYPE);
+    if (!vec)
+        return 0;
+    *out = vec->Length ? vec->Decimals : NULL;
+    *len = vec->Length;
+    return 1;
 }
 
 const char* ErrToString(int status) {
@@ -468,6 +4640,14 @@ const char* ErrToString(int status) {
         return "Array elements must follow this syntax: [ele1 , ele2, ...]";
         case INVALID_INTEGER_LITERAL: return "Invalid integer literal";
         case INVALID_DECIMAL_LITERAL: return "Invalid floating point literal";
+        case INVALID_SNAPSHOT: return "Not a valid config snapshot";
+        case SCHEMA_UNKNOWN_KEY: return "Key not in the schema";
+        case SCHEMA_TYPE_MISMATCH: return "Value of a type the schema does not allow";
+        case SCHEMA_OUT_OF_RANGE: return "Value outside the range the schema allows";
+        case SCHEMA_MISSING_KEY: return "Key the schema requires is missing";
+        case INVALID_INCLUDE: return "Includes nested too deeply, or in a cycle";
+        case TABLE_NOT_SUPPORTED: return "Tables are not supported here";
+        case OVERLAY_NOT_SUPPORTED: return "Overlays are not supported here";
         default: return "Unknown error.";
     }
 }
@@ -1,4 +1,5 @@
 #pragma once
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 
@@ -9,29 +10,66 @@ typedef struct PrimtiveValue {
         char *String;
     };
     int Type;
+    uint32_t Length; // of 'String', which need not be terminated (PARSE_ZERO_COPY)
 } PrimitiveValue;
 
-struct Value;
 typedef struct Vector {
     uint64_t Length;
-    struct Value **Data;
+    uint64_t Capacity; // elements 'Data' has room for
+    PrimitiveValue *Data; // 'Length' elements, back to back
+    int ElementType; // type shared by every element, NULL_TYPE if mixed or empty
+    union {
+        int64_t *Numbers; // copy of 'Data' iff ElementType == NUMBER_TYPE
+        double *Decimals; // copy of 'Data' iff ElementType == DECIMAL_TYPE
+    };
 } Vector;
 
 typedef struct Value {
     PrimitiveValue *Primitive;
     Vector *Array;
+    struct Config *Table; // iff TABLE_TYPE, see FindSection()
 } Value;
 
+struct Arena;
+// Instrumentation of a Config, only collected when the library is built
+// with -DCFG_STATS, see GetConfigStats(). Times are in nanoseconds
+typedef struct ConfigStats {
+    uint64_t BytesRead;
+    uint64_t Entries;
+    uint64_t ArrayElements;
+    uint64_t Allocations; // arena allocations, i.e. nodes
+    uint64_t AllocatedBytes;
+    uint64_t ParseNanos; // wall time of the whole parse
+    uint64_t LexNanos;
+    uint64_t ConvertNanos; // numeric literal conversion
+    uint64_t AllocateNanos; // getting arena blocks from malloc()
+    uint64_t Lookups; // FindValue() and friends
+    uint64_t Hits;
+    uint64_t Probes; // index slots looked at, Probes / Lookups on average
+} ConfigStats;
+
 typedef struct ConfigEntry {
     char *Key;
     Value *Value;
     struct ConfigEntry *Next;
+    uint64_t Hash; // hash of 'Key', see Config::Index
+    uint64_t SourceHash; // hash of the whole config line, 0 if unknown
+    struct Arena *Owner; // arena keeping 'Key' and 'Value' alive, see <include>
     int Type;
+    uint32_t KeyLength; // 'Key' need not be terminated (PARSE_ZERO_COPY)
 } ConfigEntry;
 
 typedef struct Config {
     uint64_t Entries;
-    ConfigEntry *List;
+    ConfigEntry *List; // in file order
+    ConfigEntry **Index; // open addressed hash table over 'List', by key
+    uint64_t IndexMask; // number of slots in 'Index' - 1
+    Value **Bound; // values of the keys in a KeyRegistry, see BindKeys()
+    uint32_t BoundCount;
+    struct Arena *Arena; // owns every node reachable from 'List'
+    ConfigStats *Stats; // NULL unless built with CFG_STATS
+    uint64_t HashSeed; // of the key hashes, 0 unless from EmbedConfig()
+    const struct Config *Base; // the one this overlays, see ParseOverlay()
 } Config;
 
 #define NULL_TYPE (0)
@@ -40,6 +78,7 @@ typedef struct Config {
 #define STRING_TYPE (3)
 #define ARRAY_TYPE (4)
 #define PRIMITIVE_TYPE (5)
+#define TABLE_TYPE (6) // key = { <config lines> };
 
 #define FILE_NO_ACCESS (-1)
 #define OUT_OF_MEMORY (-2)
@@ -49,20 +88,406 @@ typedef struct Config {
 #define INVALID_ARRAY_ELEMENT (-6)
 #define INVALID_INTEGER_LITERAL (-7)
 #define INVALID_DECIMAL_LITERAL (-8)
+#define INVALID_SNAPSHOT (-9)
+#define SCHEMA_UNKNOWN_KEY (-10)
+#define SCHEMA_TYPE_MISMATCH (-11)
+#define SCHEMA_OUT_OF_RANGE (-12)
+#define SCHEMA_MISSING_KEY (-13)
+#define INVALID_INCLUDE (-14)
+#define TABLE_NOT_SUPPORTED (-15)
+#define OVERLAY_NOT_SUPPORTED (-16)
 // Returns < 0 on failure, 1 on success
 int ParseConfig(const char *name, Config **result);
 
+// Same as ParseConfig(), but parses the 'len' bytes at 'data' instead of
+// a file. 'data' need not be NUL terminated and is not kept after return
+int ParseConfigBuffer(const char *data, size_t len, Config **result);
+
+// Flags for ParseConfigEx() and ParseConfigBufferEx()
+#define PARSE_MMAP (1 << 0) // Parse straight from a read-only mapping of the file
+// Keys and STRING_TYPE values point into the input instead of being copied.
+// They are NOT NUL terminated then, use ConfigEntry::KeyLength and
+// PrimitiveValue::Length. ParseConfigEx() keeps the file contents alive
+// until FreeConfig(), ParseConfigBufferEx() leaves that to the caller
+#define PARSE_ZERO_COPY (1 << 1)
+
+// Same as ParseConfig(), with 'flags' being a combination of PARSE_* above
+int ParseConfigEx(const char *name, int flags, Config **result);
+
+// Same as ParseConfigBuffer(), with 'flags' as for ParseConfigEx().
+// PARSE_MMAP has no meaning here
+int ParseConfigBufferEx(const char *data, size_t len, int flags,
+                        Config **result);
+
+// Same as ParseConfig(), but reads the already open descriptor 'fd' until
+// end of file. 'fd' is left open
+int ParseConfigFd(int fd, Config **result);
+
+// Same as ParseConfigEx(), with 'nthreads' threads parsing chunks of the
+// file at once (0: one per CPU). Small inputs are parsed by the caller only
+int ParseConfigParallel(const char *name, int nthreads, int flags,
+                        Config **result);
+int ParseConfigBufferParallel(const char *data, size_t len, int nthreads,
+                              int flags, Config **result);
+
+// Parses never share state: any number of them may run at once, on the
+// same or on different inputs, with nothing but allocation shared and
+// no path that aborts the process. A ParserContext is what a caller
+// making many parses keeps between them: where the last one failed, and
+// an input buffer the next one reuses. One context serves one parse at
+// a time
+typedef struct ParserContext ParserContext;
+
+typedef struct ParseError {
+    int Status; // of the last parse, as returned by it
+    const char *File; // the failure is in, NULL for buffers
+    size_t Offset; // of the failure in 'File', in bytes
+    uint32_t Line; // 1-based, 0 if the failure has no position
+    uint32_t Column; // 1-based, in bytes
+} ParseError;
+
+// Returns NULL when out of memory
+ParserContext *CreateParserContext(void);
+
+// Same as ParseConfigEx() and ParseConfigBufferEx(), recording the outcome
+// in 'ctx'. A failure in an included file is reported in that file
+int ParseConfigContext(ParserContext *ctx, const char *name, int flags,
+                       Config **result);
+int ParseConfigBufferContext(ParserContext *ctx, const char *data, size_t len,
+                             int flags, Config **result);
+
+// Outcome of the last parse with 'ctx'. 'File' stays valid until the next
+void GetParseError(const ParserContext *ctx, ParseError *err);
+
+void FreeParserContext(ParserContext *ctx);
+
+// Parse each of the 'n' files paths[i] with 'flags' into out[i] (NULL on
+// failure), storing the result of each in status[i]. 'nthreads' threads
+// (0: one per CPU) share the work, with the calling thread being one of
+// them. Returns how many files parsed, or < 0 when out of memory
+long ParseConfigs(const char **paths, size_t n, Config **out, int *status,
+                  int nthreads, int flags);
+
+// A ConfigSchema declares which keys a config may have, and of what type.
+// The parser checks every config line against it as soon as it has read
+// it, so invalid input fails on the offending line, and lines of keys the
+// schema does not know can be skipped without building anything
+typedef struct ConfigSchema ConfigSchema;
+
+// For CreateConfigSchema(): lines with undeclared keys are checked for
+// syntax and dropped, instead of failing with SCHEMA_UNKNOWN_KEY
+#define SCHEMA_SKIP_UNKNOWN (1 << 0)
+// For AddSchemaKey(): parsing fails with SCHEMA_MISSING_KEY without it
+#define SCHEMA_REQUIRED (1 << 0)
+#define SCHEMA_RANGE (1 << 1) // set by SetSchemaRange()
+
+// Returns NULL when out of memory
+ConfigSchema *CreateConfigSchema(int flags);
+
+// Declare 'Key' as PRIMITIVE_TYPE or ARRAY_TYPE 'ty' whose value, resp.
+// every element, is of 'valueType' (NULL_TYPE for any). A key may be
+// declared once per 'ty'; declaring it again replaces the declaration
+int AddSchemaKey(ConfigSchema *schema, const char *Key, int ty, int valueType,
+                 int flags);
+
+// Numbers and decimals 'Key' of 'ty' holds must lie within [min, max].
+// Numbers are compared as doubles
+int SetSchemaRange(ConfigSchema *schema, const char *Key, int ty, double min,
+                   double max);
+
+void FreeConfigSchema(ConfigSchema *schema);
+
+// Same as ParseConfigEx(), validating against 'schema' while parsing
+int ParseConfigSchema(const char *name, const ConfigSchema *schema, int flags,
+                      Config **result);
+int ParseConfigBufferSchema(const char *data, size_t len,
+                            const ConfigSchema *schema, int flags,
+                            Config **result);
+
+// A config line include 'path'; brings in every entry of the file at
+// 'path', relative to the including file (to the working directory for
+// buffers), as if it stood there. In a config using include, a later
+// definition of a key overrides all earlier ones, whatever their types,
+// so override files go after the base they include. Included files are
+// parsed with the flags and schema of the includer; a schema's required
+// keys are checked on the whole composition only. ParseConfigStream()
+// does not follow includes, it reports them through OnInclude.
+//
+// An IncludeCache keeps the parse of every file included through it, and
+// reuses it for as long as that file and all it includes are unchanged on
+// disk (same inode, size and mtime). It may be shared between threads
+typedef struct IncludeCache IncludeCache;
+
+// Returns NULL when out of memory
+IncludeCache *CreateIncludeCache(void);
+
+// Same as ParseConfigEx(), looking included files up in 'cache' first
+int ParseConfigComposed(const char *name, IncludeCache *cache, int flags,
+                        Config **result);
+
+// Configs parsed through 'cache' stay valid after this
+void FreeIncludeCache(IncludeCache *cache);
+
+// An overlay is a Config made of nothing but overrides for some keys of
+// another Config, its base, and reads as the base with them applied.
+// Every key not overridden is looked up in the base, which is neither
+// copied nor changed, so an overlay costs time and memory for its
+// overrides only. An override replaces the base's definitions of its
+// key whatever their types; tables are replaced as a whole. FindValue()
+// and everything built on it, BindKeys() and DumpConfig() see the
+// composition. SaveConfigBinary(), EmbedConfig() and ReparseConfig() (as
+// 'old') fail with OVERLAY_NOT_SUPPORTED.
+//
+// Parse the overrides in the 'len' bytes at 'data' into an overlay on
+// 'base', with 'flags' as for ParseConfigBufferEx(). Among the overrides
+// too, a later definition of a key wins. 'base' may be an overlay itself
+// and has to outlive the result, which is freed with FreeConfig()
+int ParseOverlay(const Config *base, const char *data, size_t len, int flags,
+                 Config **result);
+
+// Kinds of change reported by ReparseConfig()
+#define KEY_ADDED (1)
+#define KEY_CHANGED (2)
+#define KEY_REMOVED (3)
+
+// 'key' is 'len' bytes long and need not be NUL terminated
+typedef void (*ConfigChangeFn)(void *userdata, const char *key, uint32_t len,
+                               int change);
+
+// Parse 'name' again after it changed on disk. Config lines whose text is
+// the same as in 'old' have their nodes copied from it instead of being
+// parsed again, and 'fn' (unless NULL) is told about every key that was
+// added, changed or removed in between. 'old' is left untouched and may
+// be freed before or after the result, which holds nothing of it
+int ReparseConfig(Config *old, const char *name, int flags, Config **result,
+                  ConfigChangeFn fn, void *userdata);
+
+// Same as ReparseConfig(), over 'len' bytes at 'data'
+int ReparseConfigBuffer(Config *old, const char *data, size_t len, int flags,
+                        Config **result, ConfigChangeFn fn, void *userdata);
+
+// Events of ParseConfigStream(), in file order. Any of them may be NULL.
+// Keys and strings point into the input, are not NUL terminated and only
+// stay valid during the call. A callback returning < 0 stops the parse,
+// which then returns that value without calling OnError
+typedef struct ConfigCallbacks {
+    int (*OnKey)(void *userdata, const char *key, uint32_t len);
+    int (*OnPrimitive)(void *userdata, const PrimitiveValue *value);
+    int (*OnArrayBegin)(void *userdata);
+    int (*OnElement)(void *userdata, uint64_t index,
+                     const PrimitiveValue *value);
+    int (*OnArrayEnd)(void *userdata, uint64_t length);
+    // 'offset' is where in the input parsing failed
+    void (*OnError)(void *userdata, int status, size_t offset);
+    // An include directive, with 'path' as written. The file is not read
+    int (*OnInclude)(void *userdata, const char *path, uint32_t len);
+    // Around the lines of a table, which are reported as usual
+    int (*OnTableBegin)(void *userdata);
+    int (*OnTableEnd)(void *userdata, uint64_t entries);
+} ConfigCallbacks;
+
+// Parse 'name' without building a Config, reporting what is seen through
+// 'cb' instead. Regular files are mapped, so memory use does not grow with
+// their size; anything else is read into memory first. Returns < 0 on
+// failure, 1 on success
+int ParseConfigStream(const char *name, const ConfigCallbacks *cb,
+                      void *userdata);
+int ParseConfigStreamBuffer(const char *data, size_t len,
+                            const ConfigCallbacks *cb, void *userdata);
+
 // Serialise 'config' into 'file'
 void DumpConfig(FILE* file, Config* config);
 
+// Serialise 'config' into 'buf', like snprintf() would: at most 'size'
+// bytes including the terminator are written, and the return value is
+// the length of the full serialisation
+size_t DumpConfigToBuffer(Config* config, char* buf, size_t size);
+
+// Serialise 'config' into a malloc()ed, NUL terminated string, storing its
+// length in '*len' unless NULL. Returns NULL when out of memory
+char* DumpConfigToString(Config* config, size_t* len);
+
+// Write 'config' to 'path' as a binary snapshot, replacing any previous
+// file atomically. Returns < 0 on failure, 1 on success. Configs with
+// tables fail with TABLE_NOT_SUPPORTED
+int SaveConfigBinary(Config* config, const char* path);
+
+// Load a snapshot written by SaveConfigBinary(). The Config is mapped
+// from the file rather than parsed or allocated node by node, and is freed
+// with FreeConfig() as usual. Returns < 0 on failure, 1 on success
+int LoadConfigBinary(const char* path, Config** result);
+
+// Load 'snapshot' if it is newer than the config file 'name', otherwise
+// parse 'name' and (re)write 'snapshot' from the result
+int ParseConfigCached(const char* name, const char* snapshot,
+                      Config** result);
+
+// Write C source defining 'config' as 'const Config name', where 'name'
+// must be a C identifier. Compiled in, it needs no parsing and no heap:
+// every node is a constant, and the key index is seeded so that lookups
+// do not probe whenever the keys allow. FindValue(), FindValues() and
+// everything else that reads a Config work on it; BindKeys(),
+// ReparseConfig() with it as the result and FreeConfig() do not.
+// Returns < 0 on failure, 1 on success, TABLE_NOT_SUPPORTED for configs
+// with tables
+int EmbedConfig(FILE* file, Config* config, const char* name);
+
+// Copy 'config' into a new Config whose nodes all share one block of
+// exactly the size they need, with each distinct key and string stored
+// once. Strings are NUL terminated in the copy, which neither points into
+// the input nor keeps alive arenas shared with other configs. The result
+// reads the same as 'config', is freed with FreeConfig() on its own and
+// has no bindings, see BindKeys(). Returns < 0 on failure, 1 on success
+int CompactConfig(const Config* config, Config** result);
+
+// Memory a Config keeps alive, in bytes except for 'Allocations'
+typedef struct ConfigMemory {
+    uint64_t Total; // all of the below
+    uint64_t Nodes; // entries, values, vectors, keys and strings
+    uint64_t Overhead; // bookkeeping and unused arena space
+    uint64_t Input; // kept for PARSE_ZERO_COPY, or a mapped snapshot
+    uint64_t Shared; // arenas of nodes shared with other configs, in full
+    uint64_t Allocations; // separate heap blocks and mappings behind 'Total'
+} ConfigMemory;
+
+// Fill 'usage' for 'config'. An overlay's base is not included, and a
+// section counts as the whole config it is in. Returns < 0 when out of
+// memory, 1 on success
+int ConfigMemoryUsage(const Config* config, ConfigMemory* usage);
+
 // Free config
 void FreeConfig(Config* config);
 
 // Find value corresponding to configuration option 'Key' of type 'ty'
-Value* FindValue(Config* config, int ty, const char* Key);
+Value* FindValue(const Config* config, int ty, const char* Key);
+
+// The table 'Key' = { ... }; of 'config' as a Config of its own, with an
+// index of its own. A key inside is found without looking at any other
+// part of the config, and FindValue(), FindValues(), BindKeys(),
+// FindSection() and the typed getters work on the section as on any
+// Config. It lives as long as 'config' and is never passed to FreeConfig()
+Config* FindSection(const Config* config, const char* Key);
+
+// Copy the instrumentation of 'config' into 'stats'. Returns 0 and all
+// zeroes unless the library was built with CFG_STATS. DumpConfig() writes
+// the same counters as comments at the end of its output in such builds
+int GetConfigStats(const Config* config, ConfigStats* stats);
+
+// FindValue() for each of the 'n' keys[i] of type types[i] at once, with
+// the results in out[i]. Cheaper than a loop over FindValue() for large
+// batches, as the memory accesses of neighbouring lookups overlap.
+// Returns how many were found
+size_t FindValues(const Config* config, const char** keys, const int* types,
+                  size_t n, Value** out);
+
+// A KeyRegistry hands out small, stable handles for keys that are looked
+// up over and over. A handle identifies the key, not a Config, so the
+// same handle keeps working for every Config the registry is bound to
+typedef uint32_t LookupHandle;
+#define INVALID_LOOKUP_HANDLE (UINT32_MAX)
+
+typedef struct RegisteredKey {
+    char *Key;
+    size_t Length;
+    uint64_t Hash;
+    int Type;
+} RegisteredKey;
+
+typedef struct KeyRegistry {
+    uint32_t Count;
+    uint32_t Capacity;
+    RegisteredKey *Keys; // indexed by LookupHandle
+} KeyRegistry;
+
+// Returns NULL when out of memory
+KeyRegistry* CreateKeyRegistry(void);
+
+// Handle for 'Key' of type 'ty', registering it on first use.
+// Returns INVALID_LOOKUP_HANDLE when out of memory
+LookupHandle RegisterKey(KeyRegistry* reg, int ty, const char* Key);
+
+// Resolve every key registered so far against 'config'. Call this once
+// per parsed Config, e.g. after each reload. Returns < 0 on failure
+int BindKeys(Config* config, const KeyRegistry* reg);
+
+// Value for 'handle' in 'config', NULL if the key is absent or was
+// registered after the last BindKeys() on 'config'
+Value* GetValueByHandle(Config* config, LookupHandle handle);
+
+void FreeKeyRegistry(KeyRegistry* reg);
+
+// A ConfigSnapshot publishes one Config at a time to any number of reader
+// threads, e.g. the result of a reload. Readers never block: each thread
+// registers once and brackets its uses of the Config with AcquireConfig()
+// and ReleaseConfig(). The Config a publish replaces is freed as soon as
+// no reader holds it anymore, by that or a later PublishConfig()
+typedef struct ConfigSnapshot ConfigSnapshot;
+typedef struct ConfigReader ConfigReader;
+
+// Takes ownership of 'config' (may be NULL). Returns NULL when out of memory
+ConfigSnapshot* CreateConfigSnapshot(Config* config);
+
+// Reader slot for the calling thread, NULL when out of memory. Slots are
+// reused after UnregisterConfigReader() and live as long as 'snap'
+ConfigReader* RegisterConfigReader(ConfigSnapshot* snap);
+void UnregisterConfigReader(ConfigReader* reader);
+
+// The current Config, which stays valid until the next ReleaseConfig() or
+// AcquireConfig() on 'reader'
+Config* AcquireConfig(ConfigSnapshot* snap, ConfigReader* reader);
+void ReleaseConfig(ConfigReader* reader);
+
+// Make 'config' the current one and take ownership of it. Returns < 0
+// when out of memory, in which case nothing changed
+int PublishConfig(ConfigSnapshot* snap, Config* config);
+
+// Free 'snap' with every Config it owns. No reader may be left inside
+void DestroyConfigSnapshot(ConfigSnapshot* snap);
+
+// A ConfigWatcher reloads a config file into a ConfigSnapshot whenever it
+// changes on disk, from a background thread of its own. A burst of writes
+// is reloaded once, after the file stayed unchanged for 'debounceMillis'.
+// Reloads go through ReparseConfig() against the published Config with
+// 'flags', and 'fn' (unless NULL) is called on that thread for every key
+// that changed. A reload that fails leaves the published Config alone
+typedef struct ConfigWatcher ConfigWatcher;
+
+// Start watching 'name'. The Config in 'snap' is not touched until the
+// file changes. Unless NULL, 'reg' is bound to every reloaded Config
+// before it is published (see BindKeys()), so handles work for readers
+// from the start. It has to outlive the watcher and get no new keys
+// meanwhile. Returns NULL when out of memory or out of threads
+ConfigWatcher* WatchConfig(ConfigSnapshot* snap, const char* name, int flags,
+                           const KeyRegistry* reg, int debounceMillis,
+                           ConfigChangeFn fn, void* userdata);
+
+// Status of the last reload (0 if there was none yet), and how many there
+// were in '*reloads' unless NULL
+int ConfigWatcherStatus(const ConfigWatcher* w, uint64_t* reloads);
+
+// Stop and free 'w', waiting for a reload in progress. 'snap' stays as is
+void StopConfigWatcher(ConfigWatcher* w);
 
 // Get Element 'idx' of v, iff idx < v->Length, othwerwise NULL
 PrimitiveValue* GetElement(Vector* v, uint64_t idx);
 
+// All 'v->Length' elements of v as a plain array, iff every one of them
+// is a NUMBER_TYPE (resp. DECIMAL_TYPE), othwerwise NULL
+int64_t* GetNumbers(Vector* v);
+double* GetDecimals(Vector* v);
+
+// Typed getters: return 1 with the value of 'Key' in the out parameters
+// iff 'Key' holds a value of that type, otherwise 0 and leave them alone.
+// Strings need not be NUL terminated (PARSE_ZERO_COPY). The arrays are the
+// typed copies made while parsing, and empty arrays qualify as any type
+int GetInt64(const Config* config, const char* Key, int64_t* out);
+int GetDouble(const Config* config, const char* Key, double* out);
+int GetString(const Config* config, const char* Key, const char** out,
+              uint32_t* len);
+int GetInt64Array(const Config* config, const char* Key, const int64_t** out,
+                  uint64_t* len);
+int GetDoubleArray(const Config* config, const char* Key, const double** out,
+                   uint64_t* len);
+
 // Convert error code from ParseConfig() to string
 const char* ErrToString(int status); 
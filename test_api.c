@@ -0,0 +1,642 @@
+#define _GNU_SOURCE // pipe(), sigaction(), usleep(), mkdtemp()
+#include "cfg_parse.h"
+#include <ftw.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Behavioural checks of the API, complementing test.c which dumps a file.
+ *
+ *   cc -o test_api test_api.c cfg_parse.c -lpthread -lm && ./test_api
+ *
+ * Prints every failed check and exits with 1 if there was any.
+ */
+
+static int Checks, Failures;
+
+#define CHECK(cond)                                                            \
+    do {                                                                       \
+        Checks++;                                                              \
+        if (!(cond)) {                                                         \
+            Failures++;                                                        \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);    \
+        }                                                                      \
+    } while (0)
+
+// The integer 'key' holds in 'config', or 'missing' if it holds none
+static int64_t Number(Config *config, const char *key, int64_t missing) {
+    Value *v = FindValue(config, PRIMITIVE_TYPE, key);
+    if (!v || v->Primitive->Type != NUMBER_TYPE)
+        return missing;
+    return v->Primitive->Number;
+}
+
+static Config *Parse(const char *text) {
+    Config *config;
+    return ParseConfigBuffer(text, strlen(text), &config) > 0 ? config : NULL;
+}
+
+static char Dir[] = "/tmp/cfg_test_XXXXXX";
+
+// Path of 'name' in the scratch directory, in a static buffer
+static const char *InDir(const char *name) {
+    static char path[4][256];
+    static int next;
+    char *p = path[next++ % 4];
+    snprintf(p, sizeof(path[0]), "%s/%s", Dir, name);
+    return p;
+}
+
+static void WriteFile(const char *name, const char *text) {
+    FILE *f = fopen(InDir(name), "w");
+    fputs(text, f);
+    fclose(f);
+}
+
+static int RemoveEntry(const char *path, const struct stat *st, int flag,
+                       struct FTW *ftw) {
+    (void)st, (void)flag, (void)ftw;
+    return remove(path);
+}
+
+static char *Dump(Config *config) {
+    return DumpConfigToString(config, NULL);
+}
+
+// Whether both dump to the same text
+static int SameDump(Config *a, Config *b) {
+    char *x = Dump(a), *y = Dump(b);
+    int same = x && y && strcmp(x, y) == 0;
+    free(x);
+    free(y);
+    return same;
+}
+
+static void OnAlarm(int sig) { (void)sig; }
+
+static void *WriteLater(void *arg) {
+    int fd = *(int *)arg;
+    usleep(100 * 1000);
+    const char text[] = "late = 1;";
+    if (write(fd, text, sizeof(text) - 1) < 0)
+        perror("write");
+    close(fd);
+    return NULL;
+}
+
+static void TestInterruptedRead(void) {
+    // A signal without SA_RESTART arrives while the parse waits for input
+    struct sigaction sa = {0};
+    sa.sa_handler = OnAlarm;
+    sigaction(SIGALRM, &sa, NULL);
+    int fds[2];
+    CHECK(pipe(fds) == 0);
+    pthread_t writer;
+    pthread_create(&writer, NULL, WriteLater, &fds[1]);
+    alarm(0);
+    ualarm(20 * 1000, 0);
+
+    Config *config;
+    int status = ParseConfigFd(fds[0], &config);
+    CHECK(status == 1);
+    if (status == 1) {
+        CHECK(Number(config, "late", 0) == 1);
+        FreeConfig(config);
+    }
+    pthread_join(writer, NULL);
+    close(fds[0]);
+    signal(SIGALRM, SIG_DFL);
+}
+
+// Read every value of 'config' through the typed getters. Returns the sum
+// of what they found, for the sanitizers to trip over on bad pointers
+static double ReadAll(Config *config) {
+    double sum = 0;
+    for (ConfigEntry *ce = config->List; ce; ce = ce->Next) {
+        const int64_t *numbers;
+        const double *decimals;
+        const char *str;
+        uint32_t length;
+        uint64_t n;
+        int64_t number;
+        double decimal;
+        if (GetInt64Array(config, ce->Key, &numbers, &n)) {
+            for (uint64_t i = 0; i < n; i++)
+                sum += numbers[i];
+        }
+        if (GetDoubleArray(config, ce->Key, &decimals, &n)) {
+            for (uint64_t i = 0; i < n; i++)
+                sum += decimals[i];
+        }
+        if (GetInt64(config, ce->Key, &number))
+            sum += number;
+        if (GetDouble(config, ce->Key, &decimal))
+            sum += decimal;
+        if (GetString(config, ce->Key, &str, &length) && length)
+            sum += str[length - 1];
+    }
+    return sum;
+}
+
+static void TestSnapshot(void) {
+    Config *config =
+        Parse("a = 1; b = 'text'; c = [1.5, 2.5]; d = [1, 'x']; e = [3, 4];");
+    const char *path = InDir("config.snap");
+    CHECK(SaveConfigBinary(config, path) == 1);
+    Config *loaded;
+    CHECK(LoadConfigBinary(path, &loaded) == 1);
+    CHECK(SameDump(config, loaded));
+    CHECK(ReadAll(loaded) == 1 + 4.0 + 7 + 't');
+    FreeConfig(loaded);
+
+    // Truncated or corrupted files fail cleanly, or load something safe.
+    // Flipping the low bit too turns NULL_TYPE into NUMBER_TYPE
+    FILE *f = fopen(path, "rb");
+    char data[4096];
+    size_t len = fread(data, 1, sizeof(data), f);
+    fclose(f);
+    const char *bad = InDir("bad.snap");
+    int clean = 1;
+    for (size_t i = 0; i < len * 3; i++) {
+        char copy[4096];
+        memcpy(copy, data, len);
+        size_t n = len;
+        if (i < len)
+            n = i;
+        else
+            copy[i % len] ^= i < len * 2 ? 0x5a : 0x01;
+        f = fopen(bad, "wb");
+        fwrite(copy, 1, n, f);
+        fclose(f);
+        int status = LoadConfigBinary(bad, &loaded);
+        if (status == 1) {
+            free(Dump(loaded));
+            ReadAll(loaded);
+            FreeConfig(loaded);
+        } else if (status != INVALID_SNAPSHOT) {
+            clean = 0;
+        }
+    }
+    CHECK(clean);
+    CHECK(LoadConfigBinary(InDir("missing.snap"), &loaded) == FILE_NO_ACCESS);
+
+    Config *table = Parse("t = { a = 1; };");
+    CHECK(SaveConfigBinary(table, path) == TABLE_NOT_SUPPORTED);
+    FreeConfig(table);
+    FreeConfig(config);
+}
+
+typedef struct Changes {
+    int Added, Changed, Removed;
+} Changes;
+
+static void OnChange(void *userdata, const char *key, uint32_t len,
+                     int change) {
+    (void)key, (void)len;
+    Changes *c = userdata;
+    c->Added += change == KEY_ADDED;
+    c->Changed += change == KEY_CHANGED;
+    c->Removed += change == KEY_REMOVED;
+}
+
+static void TestReparse(void) {
+    const char *before = "a = 1; b = [1, 2]; c = 'x'; d = 4;";
+    const char *after = "a = 1; b = [1, 2]; c = 'y'; e = 5;";
+    Config *old = Parse(before), *config;
+    Changes changes = {0};
+    CHECK(ReparseConfigBuffer(old, after, strlen(after), 0, &config, OnChange,
+                              &changes) == 1);
+    CHECK(changes.Added == 1 && changes.Changed == 1 && changes.Removed == 1);
+    // Unchanged lines are copies of the old nodes, and outlive them
+    Value *b = FindValue(config, ARRAY_TYPE, "b");
+    CHECK(b && b != FindValue(old, ARRAY_TYPE, "b"));
+    CHECK(FindValue(config, PRIMITIVE_TYPE, "d") == NULL);
+    FreeConfig(old);
+    CHECK(GetNumbers(b->Array) && GetNumbers(b->Array)[1] == 2);
+    FreeConfig(config);
+
+    // Dropping the first of two definitions changes the key, although the
+    // line left is reused
+    old = Parse("a = 1; a = 2; b = 3;");
+    memset(&changes, 0, sizeof(changes));
+    CHECK(ReparseConfigBuffer(old, "a = 2; b = 3;", 13, 0, &config, OnChange,
+                              &changes) == 1);
+    CHECK(changes.Changed == 1 && changes.Added + changes.Removed == 0);
+    CHECK(Number(config, "a", 0) == 2);
+    FreeConfig(old);
+    FreeConfig(config);
+
+    // Reloads changing one line at a time cost no more than the first one
+    char text[100 * 21 + 1];
+    size_t len = 0;
+    for (int i = 0; i < 100; i++)
+        len += sprintf(text + len, "k%02d = ['0000', %d];\n", i, 100 + i);
+    old = Parse(text);
+    ConfigMemory first = {0}, last = {0};
+    int reparsed = 1;
+    for (int i = 1; i <= 2000; i++) {
+        // Lines are 21 bytes, the string's digits start at the 9th
+        sprintf(text + (i % 100) * 21 + 8, "%04d", i);
+        text[(i % 100) * 21 + 12] = '\'';
+        reparsed &= ReparseConfigBuffer(old, text, len, 0, &config, NULL,
+                                        NULL) == 1;
+        FreeConfig(old);
+        old = config;
+        ConfigMemoryUsage(config, i == 1 ? &first : &last);
+    }
+    b = FindValue(old, ARRAY_TYPE, "k99");
+    CHECK(reparsed && b && memcmp(b->Array->Data[0].String, "1999", 4) == 0);
+    CHECK(last.Total <= 2 * first.Total && last.Shared == 0);
+    FreeConfig(old);
+
+    old = Parse("a = 1;");
+    CHECK(ReparseConfig(old, InDir("missing.cfg"), 0, &config, NULL, NULL) ==
+          FILE_NO_ACCESS);
+    FreeConfig(old);
+}
+
+typedef struct Readers {
+    ConfigSnapshot *Snapshot;
+    atomic_int Stop;
+    atomic_int Torn; // configs seen with 'a' != 'b'
+} Readers;
+
+static void *Read(void *arg) {
+    Readers *r = arg;
+    ConfigReader *reader = RegisterConfigReader(r->Snapshot);
+    while (!atomic_load(&r->Stop)) {
+        Config *config = AcquireConfig(r->Snapshot, reader);
+        if (Number(config, "a", -1) != Number(config, "b", -2))
+            atomic_fetch_add(&r->Torn, 1);
+        ReleaseConfig(reader);
+    }
+    UnregisterConfigReader(reader);
+    return NULL;
+}
+
+static void TestSnapshots(void) {
+    Readers r;
+    r.Snapshot = CreateConfigSnapshot(Parse("a = 0; b = 0;"));
+    atomic_init(&r.Stop, 0);
+    atomic_init(&r.Torn, 0);
+    pthread_t threads[4];
+    for (int i = 0; i < 4; i++)
+        pthread_create(&threads[i], NULL, Read, &r);
+    int published = 1;
+    for (int i = 1; i <= 500; i++) {
+        char text[64];
+        snprintf(text, sizeof(text), "a = %d; b = %d;", i, i);
+        published &= PublishConfig(r.Snapshot, Parse(text)) == 1;
+    }
+    atomic_store(&r.Stop, 1);
+    for (int i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+    CHECK(published);
+    CHECK(atomic_load(&r.Torn) == 0);
+    DestroyConfigSnapshot(r.Snapshot);
+}
+
+static void TestParallel(void) {
+    // Big enough for several chunks, with a duplicate key across them
+    size_t cap = 4 << 20, len = 0;
+    char *text = malloc(cap);
+    len += sprintf(text + len, "dup = 1;\n");
+    for (int i = 0; len < cap - 256; i++)
+        len += sprintf(text + len, "key_%d = [%d, 'v%d'];\n# comment\n", i, i,
+                       i);
+    len += sprintf(text + len, "dup = 2;\n");
+
+    Config *serial, *parallel;
+    CHECK(ParseConfigBuffer(text, len, &serial) == 1);
+    CHECK(ParseConfigBufferParallel(text, len, 4, 0, &parallel) == 1);
+    CHECK(serial->Entries == parallel->Entries);
+    CHECK(SameDump(serial, parallel));
+    CHECK(Number(parallel, "dup", 0) == 1);
+    CHECK(FindValue(parallel, ARRAY_TYPE, "key_12345") != NULL);
+    FreeConfig(serial);
+    FreeConfig(parallel);
+
+    // An error in a late chunk fails the whole parse
+    memcpy(text + len - 9, "dup = ;\n", 8);
+    CHECK(ParseConfigBufferParallel(text, len, 4, 0, &parallel) ==
+          UNEXPECTED_TOKEN);
+    free(text);
+}
+
+// Parse 'literal' as the value of a config line, the same way strtod()
+// would read it
+static int SameAsStrtod(const char *literal) {
+    char line[512];
+    snprintf(line, sizeof(line), "d = %s;", literal);
+    Config *config = Parse(line);
+    Value *v = config ? FindValue(config, PRIMITIVE_TYPE, "d") : NULL;
+    int ok = v && v->Primitive->Type == DECIMAL_TYPE;
+    double d = ok ? v->Primitive->Decimal : 0;
+    double want = strtod(literal, NULL);
+    if (config)
+        FreeConfig(config);
+    return ok && memcmp(&d, &want, sizeof(double)) == 0;
+}
+
+static void TestDecimals(void) {
+    // Clinger's fast path
+    CHECK(SameAsStrtod("0.5"));
+    CHECK(SameAsStrtod("123456.789"));
+    CHECK(SameAsStrtod("1.5e10"));
+    // The slow path: too many digits, or exponents beyond +-22
+    CHECK(SameAsStrtod("0.30000000000000004"));
+    CHECK(SameAsStrtod("1.00000000000000000001"));
+    CHECK(SameAsStrtod("123456789012345678901234567890.5"));
+    CHECK(SameAsStrtod("9007199254740993.0"));
+    CHECK(SameAsStrtod("0.0000000000000000000000001"));
+    CHECK(SameAsStrtod("0.1234567890123456789012345678901234567890123456789"
+                       "0123456789012345678901234567890123456789"));
+    CHECK(SameAsStrtod("1.0e23"));
+    CHECK(SameAsStrtod("2.5e300"));
+    CHECK(SameAsStrtod("1.0e400"));
+
+    srand(17);
+    int same = 1;
+    for (int i = 0; i < 10000 && same; i++) {
+        char literal[64];
+        int n = sprintf(literal, "%d.", rand() % 100000);
+        for (int j = rand() % 30; j >= 0; j--)
+            literal[n++] = (char)('0' + rand() % 10);
+        literal[n] = '\0';
+        same = SameAsStrtod(literal);
+        if (!same)
+            printf("decimal %s\n", literal);
+    }
+    CHECK(same);
+}
+
+static void TestErrors(void) {
+    ParserContext *ctx = CreateParserContext();
+    Config *config;
+    const char *text = "a = 1;\nb = [1, 2;\n";
+    ParseError err;
+    CHECK(ParseConfigBufferContext(ctx, text, strlen(text), 0, &config) ==
+          UNEXPECTED_TOKEN);
+    GetParseError(ctx, &err);
+    CHECK(err.Status == UNEXPECTED_TOKEN && err.Line == 2 && err.Column == 10);
+    CHECK(ParseConfigContext(ctx, InDir("missing.cfg"), 0, &config) ==
+          FILE_NO_ACCESS);
+    FreeParserContext(ctx);
+
+    ConfigSchema *schema = CreateConfigSchema(0);
+    AddSchemaKey(schema, "port", PRIMITIVE_TYPE, NUMBER_TYPE, SCHEMA_REQUIRED);
+    SetSchemaRange(schema, "port", PRIMITIVE_TYPE, 1, 65535);
+    CHECK(ParseConfigBufferSchema("port = 80;", 10, schema, 0, &config) == 1);
+    FreeConfig(config);
+    CHECK(ParseConfigBufferSchema("port = 0;", 9, schema, 0, &config) ==
+          SCHEMA_OUT_OF_RANGE);
+    CHECK(ParseConfigBufferSchema("x = 1;", 6, schema, 0, &config) ==
+          SCHEMA_UNKNOWN_KEY);
+    CHECK(ParseConfigBufferSchema("", 0, schema, 0, &config) ==
+          SCHEMA_MISSING_KEY);
+    FreeConfigSchema(schema);
+}
+
+typedef struct Seen {
+    int Keys;
+    int Includes;
+    char Path[64];
+} Seen;
+
+static int OnKey(void *userdata, const char *key, uint32_t len) {
+    (void)key, (void)len;
+    ((Seen *)userdata)->Keys++;
+    return 1;
+}
+
+static int OnInclude(void *userdata, const char *path, uint32_t len) {
+    Seen *seen = userdata;
+    seen->Includes++;
+    snprintf(seen->Path, sizeof(seen->Path), "%.*s", (int)len, path);
+    return 1;
+}
+
+static void TestWatch(void) {
+    // Readers get the reload already bound to the registry
+    WriteFile("watch.cfg", "a = 1;");
+    Config *config;
+    CHECK(ParseConfig(InDir("watch.cfg"), &config) == 1);
+    KeyRegistry *reg = CreateKeyRegistry();
+    LookupHandle a = RegisterKey(reg, PRIMITIVE_TYPE, "a");
+    BindKeys(config, reg);
+    ConfigSnapshot *snap = CreateConfigSnapshot(config);
+    ConfigWatcher *w = WatchConfig(snap, InDir("watch.cfg"), 0, reg, 10, NULL,
+                                   NULL);
+    CHECK(w != NULL);
+    WriteFile("watch.cfg", "a = 2;");
+    uint64_t reloads = 0;
+    for (int i = 0; i < 500 && !reloads; i++) {
+        usleep(10000);
+        ConfigWatcherStatus(w, &reloads);
+    }
+    CHECK(reloads && ConfigWatcherStatus(w, NULL) == 1);
+
+    ConfigReader *reader = RegisterConfigReader(snap);
+    Value *v = GetValueByHandle(AcquireConfig(snap, reader), a);
+    CHECK(v && v->Primitive->Number == 2);
+    ReleaseConfig(reader);
+    UnregisterConfigReader(reader);
+    StopConfigWatcher(w);
+    DestroyConfigSnapshot(snap);
+    FreeKeyRegistry(reg);
+}
+
+static void TestStream(void) {
+    ConfigCallbacks cb = {0};
+    cb.OnKey = OnKey;
+    cb.OnInclude = OnInclude;
+    const char *text = "a = 1;\n"
+                       "include 'other.cfg';\n"
+                       "t = { include 'x'; b = 2; };\n"
+                       "include = 3;\n";
+    Seen seen = {0};
+    CHECK(ParseConfigStreamBuffer(text, strlen(text), &cb, &seen) == 1);
+    CHECK(seen.Keys == 4);
+    CHECK(seen.Includes == 2);
+    CHECK(strcmp(seen.Path, "x") == 0);
+
+    // Without a callback the directive is skipped
+    ConfigCallbacks none = {0};
+    CHECK(ParseConfigStreamBuffer(text, strlen(text), &none, NULL) == 1);
+    CHECK(ParseConfigStreamBuffer("include 'x'", 11, &none, NULL) ==
+          UNEXPECTED_EOF);
+}
+
+static void TestIncludes(void) {
+    WriteFile("base.cfg", "a = 1; b = 2; c = [1];");
+    WriteFile("top.cfg", "include 'base.cfg';\nb = 'over'; c = 3;");
+    Config *config;
+    CHECK(ParseConfig(InDir("top.cfg"), &config) == 1);
+    int64_t n = 0;
+    const char *str = NULL;
+    uint32_t len = 0;
+    CHECK(GetInt64(config, "a", &n) && n == 1);
+    CHECK(GetString(config, "b", &str, &len) && len == 4);
+    CHECK(GetInt64(config, "c", &n) && n == 3);
+    CHECK(FindValue(config, ARRAY_TYPE, "c") == NULL);
+    CHECK(config->Entries == 3);
+    FreeConfig(config);
+
+    WriteFile("loop1.cfg", "include 'loop2.cfg';");
+    WriteFile("loop2.cfg", "include 'loop1.cfg';");
+    CHECK(ParseConfig(InDir("loop1.cfg"), &config) == INVALID_INCLUDE);
+    WriteFile("broken.cfg", "include 'nowhere.cfg';");
+    CHECK(ParseConfig(InDir("broken.cfg"), &config) == FILE_NO_ACCESS);
+
+    // The cache reuses a parse until the file changes on disk
+    IncludeCache *cache = CreateIncludeCache();
+    Config *first, *second;
+    CHECK(ParseConfigComposed(InDir("top.cfg"), cache, 0, &first) == 1);
+    CHECK(ParseConfigComposed(InDir("top.cfg"), cache, 0, &second) == 1);
+    CHECK(SameDump(first, second));
+    FreeConfig(second);
+    WriteFile("base.cfg", "a = 100; b = 2; c = [1];");
+    CHECK(ParseConfigComposed(InDir("top.cfg"), cache, 0, &second) == 1);
+    CHECK(GetInt64(second, "a", &n) && n == 100);
+    FreeIncludeCache(cache);
+    CHECK(GetInt64(first, "a", &n) && n == 1);
+    FreeConfig(first);
+    FreeConfig(second);
+
+    // A reparse reads what a table includes again, the line being the same
+    WriteFile("table.cfg", "t = { include 'base.cfg'; };");
+    CHECK(ParseConfig(InDir("table.cfg"), &first) == 1);
+    WriteFile("base.cfg", "a = 7;");
+    CHECK(ReparseConfig(first, InDir("table.cfg"), 0, &second, NULL, NULL) ==
+          1);
+    CHECK(GetInt64(FindSection(second, "t"), "a", &n) && n == 7);
+    FreeConfig(first);
+    FreeConfig(second);
+}
+
+static void TestParseConfigs(void) {
+    enum { FILES = 200 };
+    const char *paths[FILES];
+    char names[FILES][256];
+    for (int i = 0; i < FILES; i++) {
+        char name[32], text[64];
+        snprintf(name, sizeof(name), "bulk%d.cfg", i);
+        snprintf(text, sizeof(text), i % 50 == 7 ? "n = ;" : "n = %d;", i);
+        if (i % 50 != 3)
+            WriteFile(name, text);
+        snprintf(names[i], sizeof(names[i]), "%s", InDir(name));
+        paths[i] = names[i];
+    }
+
+    for (int threads = 0; threads <= 4; threads += 4) {
+        Config *out[FILES];
+        int status[FILES];
+        CHECK(ParseConfigs(paths, FILES, out, status, threads, 0) ==
+              FILES - 8);
+        int right = 1;
+        for (int i = 0; i < FILES; i++) {
+            int64_t n = -1;
+            if (i % 50 == 3)
+                right &= status[i] == FILE_NO_ACCESS && !out[i];
+            else if (i % 50 == 7)
+                right &= status[i] == UNEXPECTED_TOKEN && !out[i];
+            else
+                right &= status[i] == 1 && GetInt64(out[i], "n", &n) &&
+                         n == i;
+            if (out[i])
+                FreeConfig(out[i]);
+        }
+        CHECK(right);
+    }
+    CHECK(ParseConfigs(paths, 0, NULL, NULL, 4, 0) == 0);
+}
+
+static void TestOverlays(void) {
+    Config *base = Parse("a = 1; b = 'x'; a = [1, 2]; t = { h = 'h'; };");
+    const char *text = "a = 7; n = 1; t = { p = 2; }; n = 2;";
+    Config *overlay, *top;
+    CHECK(ParseOverlay(base, text, strlen(text), 0, &overlay) == 1);
+    CHECK(overlay->Entries == 3);
+    int64_t n = 0;
+    CHECK(GetInt64(overlay, "a", &n) && n == 7);
+    CHECK(GetInt64(overlay, "n", &n) && n == 2);
+    // The override hides every definition of its key in the base
+    CHECK(FindValue(overlay, ARRAY_TYPE, "a") == NULL);
+    CHECK(FindValue(base, ARRAY_TYPE, "a") != NULL);
+    CHECK(FindValue(overlay, PRIMITIVE_TYPE, "b") ==
+          FindValue(base, PRIMITIVE_TYPE, "b"));
+    CHECK(FindValue(FindSection(overlay, "t"), PRIMITIVE_TYPE, "h") == NULL);
+
+    CHECK(ParseOverlay(overlay, "b = 3;", 6, 0, &top) == 1);
+    char *dump = Dump(top);
+    CHECK(dump && strcmp(dump, "a = 7;\nb = 3;\nt = {\n    p = 2;\n};\n"
+                               "n = 2;\n") == 0);
+    free(dump);
+
+    Config *copy;
+    CHECK(SaveConfigBinary(top, InDir("o.snap")) == OVERLAY_NOT_SUPPORTED);
+    CHECK(ReparseConfigBuffer(top, "a = 1;", 6, 0, &copy, NULL, NULL) ==
+          OVERLAY_NOT_SUPPORTED);
+    CHECK(ParseOverlay(base, "a = ;", 5, 0, &copy) == UNEXPECTED_TOKEN);
+    FreeConfig(top);
+    FreeConfig(overlay);
+    FreeConfig(base);
+}
+
+static void TestCompact(void) {
+    const char *text = "a = 1; a = [1, 2]; s = 'str'; s2 = 'str';"
+                       "t = { host = 'str'; n = { x = 1.5; }; }; e = [];";
+    Config *config, *compact;
+    CHECK(ParseConfigBufferEx(text, strlen(text), PARSE_ZERO_COPY, &config) ==
+          1);
+    CHECK(CompactConfig(config, &compact) == 1);
+    CHECK(SameDump(config, compact));
+    ConfigMemory before, after;
+    CHECK(ConfigMemoryUsage(config, &before) == 1);
+    CHECK(ConfigMemoryUsage(compact, &after) == 1);
+    CHECK(after.Total < before.Total && after.Input == 0);
+    CHECK(after.Total ==
+          after.Nodes + after.Overhead + after.Input + after.Shared);
+    FreeConfig(config);
+
+    // Interned, terminated, and independent of the original
+    const char *a = NULL, *b = NULL;
+    uint32_t len;
+    CHECK(GetString(compact, "s", &a, &len) && GetString(compact, "s2", &b,
+                                                         &len));
+    CHECK(a == b && strcmp(a, "str") == 0);
+    CHECK(FindValue(FindSection(FindSection(compact, "t"), "n"),
+                    PRIMITIVE_TYPE, "x") != NULL);
+    const int64_t *numbers;
+    uint64_t count;
+    CHECK(GetInt64Array(compact, "a", &numbers, &count) && count == 2 &&
+          numbers[1] == 2);
+    FreeConfig(compact);
+}
+
+int main(void) {
+    if (!mkdtemp(Dir)) {
+        perror(Dir);
+        return 1;
+    }
+    TestInterruptedRead();
+    TestSnapshot();
+    TestReparse();
+    TestSnapshots();
+    TestParallel();
+    TestDecimals();
+    TestErrors();
+    TestWatch();
+    TestStream();
+    TestIncludes();
+    TestParseConfigs();
+    TestOverlays();
+    TestCompact();
+    nftw(Dir, RemoveEntry, 8, FTW_DEPTH | FTW_PHYS);
+
+    printf("%d checks, %d failed\n", Checks, Failures);
+    return Failures != 0;
+}